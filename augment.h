@@ -0,0 +1,198 @@
+#pragma once
+
+#include <compare>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Augmentation policies for the Nodes (see SimpleNode, RBNode, AVLNode). An
+// augmentation is data about the whole subtree of a Node cached in it, e.g.
+// the number of nodes in the subtree. A policy must:
+//  - be default constructible and copyable (update() is called on every new
+//    Node before its data is used);
+//  - have a method template void update(const Node &node) which recomputes
+//    the data of node from node itself and the augments of its children
+//    (node.left->augment and node.right->augment, if they are not null).
+// The Node stores the policy in its field augment and calls update() from its
+// own update(), so the data is kept up to date through insertions, deletions
+// and rotations.
+
+
+// No augmentation (takes no space in the Node).
+struct no_augment
+{
+    template <class Node>
+    void update(const Node &) {}
+};
+
+
+// Number of Nodes in the subtree. Lets the tree find the rank of a key and
+// the Node with a given rank in O(log n) (see BaseTree::rank).
+struct subtree_size
+{
+    std::uint32_t size = 1;
+
+    template <class Node>
+    void update(const Node &node)
+    {
+        this->size = 1 +
+            (node.left == nullptr ? 0 : node.left->augment.size) +
+            (node.right == nullptr ? 0 : node.right->augment.size);
+    }
+};
+
+
+// Node with subtree sizes (see subtree_size).
+template <class Node>
+concept sized_node = requires (const Node &node)
+{
+    { node.augment.size } -> std::convertible_to<std::size_t>;
+};
+
+
+// Aggregate of the items of the subtree (in order of keys) under an
+// associative operation with an identity, i.e. a monoid. Lets the tree
+// aggregate the items in a range of keys in O(log n) (see
+// BaseTree::aggregate). Monoid must have:
+//  - a type type (of the aggregates);
+//  - a static method type identity();
+//  - a static method type combine(const type &a, const type &b), which must be
+//    associative (but not necessarily commutative);
+//  - a static method template type of(const K &key, const V &value), the
+//    aggregate of a single item.
+template <class Monoid>
+struct aggregate
+{
+    using monoid = Monoid;
+
+    typename Monoid::type total = Monoid::identity();
+
+    template <class Node>
+    void update(const Node &node)
+    {
+        this->total = Monoid::of(node.key, node.value);
+        if (node.left != nullptr)
+        {
+            this->total = Monoid::combine(node.left->augment.total, this->total);
+        }
+        if (node.right != nullptr)
+        {
+            this->total = Monoid::combine(this->total, node.right->augment.total);
+        }
+    }
+};
+
+// Node with aggregates (see aggregate).
+template <class Node>
+concept aggregate_node = requires (const Node &node)
+{
+    typename decltype(node.augment)::monoid;
+    node.augment.total;
+};
+
+
+// Monoids for aggregate: sum, minimum and maximum of values (of arithmetic
+// type T).
+
+template <typename T>
+struct value_sum
+{
+    using type = T;
+
+    static type identity() { return T(); }
+
+    static type combine(const type &a, const type &b) { return a + b; }
+
+    template <typename K, typename V>
+    static type of(const K &, const V &value) { return T(value); }
+};
+
+template <typename T>
+struct value_min
+{
+    using type = T;
+
+    static type identity() { return std::numeric_limits<T>::max(); }
+
+    static type combine(const type &a, const type &b) { return b < a ? b : a; }
+
+    template <typename K, typename V>
+    static type of(const K &, const V &value) { return T(value); }
+};
+
+template <typename T>
+struct value_max
+{
+    using type = T;
+
+    static type identity() { return std::numeric_limits<T>::lowest(); }
+
+    static type combine(const type &a, const type &b) { return a < b ? b : a; }
+
+    template <typename K, typename V>
+    static type of(const K &, const V &value) { return T(value); }
+};
+
+
+// Closed interval [lo, hi] of points of type T, for keys of an interval tree
+// (see "interval_tree.h"). Intervals are ordered by lo, then by hi.
+template <typename T>
+struct interval
+{
+    using point_type = T;
+
+    T lo;
+    T hi;
+
+    auto operator<=>(const interval<T> &) const = default;
+
+    // the interval has common points with [_lo, _hi]
+    bool overlaps(const T &_lo, const T &_hi) const { return !(this->hi < _lo) && !(_hi < this->lo); }
+};
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+    #include <ostream>
+
+    template <typename T>
+    std::ostream &operator<<(std::ostream &out, const interval<T> &i)
+    {
+        return out << "[" << i.lo << ", " << i.hi << "]";
+    }
+
+#endif
+
+// Greatest upper end of the interval keys (see interval) in the subtree. Lets
+// the tree find the intervals that overlap a given one without looking into
+// the subtrees where all the intervals end before it (see
+// BaseTree::for_each_overlapping).
+template <typename T>
+struct interval_augment
+{
+    T max_end{};
+
+    template <class Node>
+    void update(const Node &node)
+    {
+        this->max_end = node.key.hi;
+        if (node.left != nullptr && this->max_end < node.left->augment.max_end)
+        {
+            this->max_end = node.left->augment.max_end;
+        }
+        if (node.right != nullptr && this->max_end < node.right->augment.max_end)
+        {
+            this->max_end = node.right->augment.max_end;
+        }
+    }
+};
+
+// Node with interval keys and the ends of their subtrees (see
+// interval_augment).
+template <class Node>
+concept interval_node = requires (const Node &node)
+{
+    node.key.lo;
+    node.key.hi;
+    node.augment.max_end;
+};
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "base.h"
+
+#include <cstdint>
+
+// AVL tree Node: heights of the subtrees of any Node differ by at most 1.
+// It is stricter than the balance of the red-black tree, so the tree is
+// shallower (which means faster lookups) at the cost of more rotations
+// during modifications.
+template <typename kT, typename vT, class Augment = no_augment>
+struct AVLNode
+{
+    kT key;
+    vT value;
+
+    AVLNode<kT, vT, Augment> *parent;
+
+    AVLNode<kT, vT, Augment> *left;
+    AVLNode<kT, vT, Augment> *right;
+
+    // height of the subtree (see update)
+    std::uint32_t height;
+
+    // data about the subtree (see "augment.h"), maintained by update
+    [[no_unique_address]] Augment augment;
+
+    template <typename K, typename... Args>
+    AVLNode(AVLNode *_parent, K &&_key, Args&&... args):
+        key(std::forward<K>(_key)),
+        value(std::forward<Args>(args)...),
+        parent(_parent),
+        left(nullptr),
+        right(nullptr),
+        height(1),
+        augment()
+    {}
+
+    AVLNode(const AVLNode<kT, vT, Augment> &other):
+        key(other.key),
+        value(other.value),
+        parent(nullptr),
+        left(nullptr),
+        right(nullptr),
+        height(other.height),
+        augment(other.augment)
+    {}
+
+    AVLNode() = delete;
+    AVLNode(AVLNode<kT, vT, Augment> &&) = delete;
+
+    void update()
+    {
+        std::uint32_t left_h = this->left == nullptr ? 0 : this->left->height;
+        std::uint32_t right_h = this->right == nullptr ? 0 : this->right->height;
+        this->height = 1 + (left_h > right_h ? left_h : right_h);
+        this->augment.update(*this);
+    }
+
+    // height of the left subtree minus height of the right one
+    int balance() const
+    {
+        int left_h = this->left == nullptr ? 0 : this->left->height;
+        int right_h = this->right == nullptr ? 0 : this->right->height;
+        return left_h - right_h;
+    }
+
+    void rotate_left()
+    {
+        AVLNode<kT, vT, Augment> *pivot = this->right;
+
+        pivot->parent = this->parent;
+        if (this->parent != nullptr)
+        {
+            if (this->parent->left == this)
+            {
+                this->parent->left = pivot;
+            }
+            else
+            {
+                this->parent->right = pivot;
+            }
+        }
+
+        this->right = pivot->left;
+        if (pivot->left != nullptr)
+        {
+            pivot->left->parent = this;
+        }
+
+        this->parent = pivot;
+        pivot->left = this;
+
+        this->update();
+        pivot->update();
+    }
+
+    void rotate_right()
+    {
+        AVLNode<kT, vT, Augment> *pivot = this->left;
+
+        pivot->parent = this->parent;
+        if (this->parent != nullptr)
+        {
+            if (this->parent->right == this)
+            {
+                this->parent->right = pivot;
+            }
+            else
+            {
+                this->parent->left = pivot;
+            }
+        }
+
+        this->left = pivot->right;
+        if (pivot->right != nullptr)
+        {
+            pivot->right->parent = this;
+        }
+
+        this->parent = pivot;
+        pivot->right = this;
+
+        this->update();
+        pivot->update();
+    }
+
+    // Restore the balance of this if it is violated (children must be
+    // balanced and their heights must be up to date).
+    // Returns the node that takes the place of this.
+    AVLNode<kT, vT, Augment> *rebalance()
+    {
+        int b = this->balance();
+        if (b > 1)
+        {
+            if (this->left->balance() < 0)
+            {
+                this->left->rotate_left();
+            }
+            this->rotate_right();
+            return this->parent;
+        }
+        if (b < -1)
+        {
+            if (this->right->balance() > 0)
+            {
+                this->right->rotate_right();
+            }
+            this->rotate_left();
+            return this->parent;
+        }
+        return this;
+    }
+
+    void adjust_insert()
+    {
+        // go up updating heights until the height of a subtree does not
+        // change; after the insertion, a single (or double) rotation restores
+        // the height of the subtree, so nothing above it has to be fixed
+        for (AVLNode<kT, vT, Augment> *node = this->parent; node != nullptr; node = node->parent)
+        {
+            std::uint32_t old_height = node->height;
+            node->update();
+            if (node->balance() > 1 || node->balance() < -1)
+            {
+                node->rebalance();
+                return;
+            }
+            if (node->height == old_height)
+            {
+                return;
+            }
+        }
+    }
+
+    void adjust_build(std::size_t, std::size_t)
+    {
+        // built tree is already balanced, heights are set by update
+        return;
+    }
+
+    // make the parent of this point to replacement instead
+    void replace_with(AVLNode<kT, vT, Augment> *replacement)
+    {
+        if (replacement != nullptr)
+        {
+            replacement->parent = this->parent;
+        }
+
+        if (this->parent != nullptr)
+        {
+            if (this->parent->left == this)
+            {
+                this->parent->left = replacement;
+            }
+            else
+            {
+                this->parent->right = replacement;
+            }
+        }
+    }
+
+    void adjust_delete()
+    {
+        if (this->left != nullptr && this->right != nullptr)
+        {
+            // rightmost node from the left subtree is taken out (rebalancing
+            // the tree) and then put in place of this
+            AVLNode<kT, vT, Augment> *replacement;
+            for (
+                replacement = this->left;
+                replacement->right != nullptr;
+                replacement = replacement->right
+            );
+
+            replacement->adjust_delete();
+
+            replacement->height = this->height;
+            replacement->left = this->left;
+            replacement->right = this->right;
+            if (replacement->left != nullptr)
+            {
+                replacement->left->parent = replacement;
+            }
+            if (replacement->right != nullptr)
+            {
+                replacement->right->parent = replacement;
+            }
+            this->replace_with(replacement);
+            return;
+        }
+
+        // now this has at most 1 child, which takes the place of this
+        this->replace_with(this->left == nullptr ? this->right : this->left);
+
+        // unlike insertion, a rotation after the deletion may decrease the
+        // height of a subtree, so every node up to the root might need one
+        for (AVLNode<kT, vT, Augment> *node = this->parent; node != nullptr; node = node->parent)
+        {
+            node->update();
+            node = node->rebalance();
+        }
+    }
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+    bool is_valid() const
+    {
+        if (this->balance() > 1 || this->balance() < -1)
+        {
+            LOGV("invalid avltree: unbalanced node");
+            return false;
+        }
+
+        std::uint32_t left_h = this->left == nullptr ? 0 : this->left->height;
+        std::uint32_t right_h = this->right == nullptr ? 0 : this->right->height;
+        if (this->height != 1 + (left_h > right_h ? left_h : right_h))
+        {
+            LOGV("invalid avltree: wrong cached height");
+            return false;
+        }
+
+        return (this->left == nullptr || this->left->is_valid()) &&
+            (this->right == nullptr || this->right->is_valid());
+    }
+
+    void print() const
+    {
+        std::cout << this->key << " : " << this->value <<
+            " [h=" << this->height << "]" << std::endl;
+    }
+
+#endif
+};
+
+template <typename kT, typename vT, class Compare = default_compare, class Augment = no_augment>
+using AVLTree = BaseTree<kT, vT, AVLNode<kT, vT, Augment>, Compare>;
+
+static_assert(key_value_tree<AVLTree<int, int>>);
@@ -1,20 +1,52 @@
 #pragma once
 
+#include "augment.h"
 #include "common.h"
+#include "fork_join.h"
+#include "frozen_tree.h"
+#include "interleave.h"
+#include "key_compare.h"
+#include "node_pool.h"
 #include "target_interface.h"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <compare>
+#include <concepts>
+#include <cstdint>
 #include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <mutex>
 #include <queue>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Node that can join trees (see join in the requirements for the Node below).
+template <class Node>
+concept joinable_node = requires (Node *node)
+{
+    { Node::join(node, node, node) } -> std::same_as<Node*>;
+};
 
-// General implementation of the KeyValueTree interface. Except typenames kT
+
+// General implementation of the key_value_tree interface (see
+// "target_interface.h"; VirtualTree<BaseTree<...>> implements KeyValueTree
+// if dynamic dispatch is needed). Except typenames kT
 // and vT also requires a Node class as a template parameter. This class controls
 // the behavior of the tree. It must:
 //  - have fields key (of type kT) and value (of type vT);
 //  - have fields parent, left and right (of type Node*, i.e. ptr to another
 //    instance of the same class);
-//  - have constructor with signature (std::pair<kT, vT>&, Node*), where first
-//    argument is an item to be stored at this node and second is a ptr to the
-//    parent node (children should be initialized with nullptr);
+//  - have constructor template with signature (Node*, K&&, Args&&...), where
+//    first argument is a ptr to the parent node (children should be
+//    initialized with nullptr), the key is constructed from the second one and
+//    the value is constructed in place from the rest (value-initialized if
+//    there are none);
 //  - have copy constructor (which should not copy pointer values but initialize
 //    them with nullptr);
 //  - have a method void adjust_insert() which is called on the Node right after
@@ -24,7 +56,37 @@
 //    about to be deleted right before the deletion. This method should make
 //    sure that after the deletion of the node the tree will still be valid and
 //    there will be no memory leak. It also should implement balancing in a
-//    self-balancing tree);
+//    self-balancing tree). If the Node has both children, it must be replaced
+//    by its in-order predecessor (the rightmost Node of the left subtree);
+//  - have a method void adjust_build(std::size_t depth, std::size_t height)
+//    which is called on every Node of a tree constructed from a sorted range
+//    (see BaseTree::assign); such a tree is perfectly balanced, its nodes are
+//    visited in post-order (children first), depth is the depth of the Node
+//    (1 for the root) and height is the depth of the whole tree;
+//  - [optional] have a method void update() which recomputes the data cached
+//    in the Node from its children (e.g. the height of the subtree). The tree
+//    calls it on every Node whose subtree has changed after insertion,
+//    deletion or building, bottom to top, except for the Nodes that change
+//    places during balancing: the Node must call update() itself on those
+//    (e.g. in rotations), lower ones first;
+//  - [optional] have a field height (an unsigned integer) with the height of
+//    the subtree of the Node (1 for a leaf), maintained by update(). If it is
+//    present, depth() is O(1);
+//  - [optional] have a field augment with the data about the subtree of the
+//    Node (see "augment.h"), maintained by update(). If it counts the Nodes
+//    of the subtree (see sized_node), rank(), select() and count_range()
+//    are available; if it aggregates the items (see aggregate_node),
+//    aggregate() is; if the keys are intervals and it keeps their greatest
+//    end (see interval_node), for_each_overlapping() is;
+//  - [optional] have a static method Node *join(Node *left, Node *middle,
+//    Node *right) which makes one valid tree of the (detached) trees left
+//    and right and the Node middle between them (all the keys of left are
+//    less than the key of middle, which is less than all the keys of right)
+//    and returns its root; any subtrees of valid trees may be joined. With it
+//    (see joinable_node) and an allocator that can share Nodes, the tree
+//    supports split(), join() and set operations (their bounds below assume
+//    that join takes O(difference of the heights of left and right) steps,
+//    which needs heights cached in the Nodes, like RBNode::black_height);
 //  - [debug only] have a method bool is_valid() that tells if a tree is valid;
 //    in debub mode, this method will be called after each call to insert_at / 
 //    delete_at and, it returns false, an exception will be thrown;
@@ -34,19 +96,92 @@
 // The SimpleNode class in "simple_tree.h" may serve as a basic example of how
 // to implement Node class.
 //
+// Compare is the comparator for the keys (see "key_compare.h" for
+// requirements). By default (default_compare), keys are compared with
+// operator<=> if they have it, so the search makes one comparison per level,
+// and with operator< otherwise; lookups are transparent (any type comparable
+// with kT may be used as a key for lookup).
+//
+// The last template parameter is a policy that controls how the memory for the
+// Nodes is allocated (see "node_pool.h" for requirements). By default, Nodes
+// are placed in a NodePool owned by the tree.
+//
 // It is also a good idea to provide template alias for BaseTree next to the Node
 // implementation.
-template <typename kT, typename vT, class Node>
-class BaseTree : public KeyValueTree<kT,vT>
+template <
+    typename kT, typename vT, class Node,
+    class Compare = default_compare,
+    class Alloc = NodePool<Node>
+>
+class BaseTree
 {
 private:
 
-    // Utility function used by copy ctor and assignment.
-    Node *copy_node(Node *other, Node *parent);
+    // number of searches advanced together by find_batch
+    static constexpr std::size_t BATCH_GROUP = 16;
+
+    [[no_unique_address]] Compare comp;
+
+    Alloc alloc;
+
+    // Copy the subtree of other and attach the copy to parent (used by copy
+    // ctor and assignment). n is the number of Nodes in the subtree (0 if
+    // unknown, then it is counted if the allocator can reserve slots). Nodes
+    // are copied in pre-order without recursion, so the copy of a subtree
+    // takes consecutive slots if the allocator can reserve them.
+    // While forks is positive, the left subtrees of large Nodes are copied on
+    // other threads (see build_node).
+    Node *copy_node(Alloc &alloc, const Node *other, Node *parent, std::size_t n, unsigned forks);
+
+    // Copy other into this tree (which must be empty).
+    void copy_from(const BaseTree<kT, vT, Node, Compare, Alloc> &other);
 
     Node *root;
     std::size_t _size;
 
+    // The last inserted node and the node with the greatest key (or
+    // nullptr): inserts look for the place of the key starting from them
+    // (see search_near).
+    Node *finger;
+    Node *max_node;
+
+    // For Nodes that aggregate the values (see aggregate_node): the nodes
+    // whose values may have been changed through the references given out by
+    // operator[] and lookup. Their aggregates are brought up to date (see
+    // refresh) before they are read or the nodes leave the tree.
+    struct stale_nodes
+    {
+        std::vector<Node*> nodes;
+
+        // refresh may run in concurrent const calls, so it checks the flag
+        // first and then takes the lock
+        std::atomic<bool> any = false;
+        std::mutex lock;
+
+        stale_nodes() = default;
+
+        stale_nodes(stale_nodes &&other) noexcept:
+            nodes(std::move(other.nodes)),
+            any(other.any.exchange(false))
+        {}
+
+        stale_nodes &operator=(stale_nodes &&other) noexcept
+        {
+            this->nodes = std::move(other.nodes);
+            this->any = other.any.exchange(false);
+            return *this;
+        }
+    };
+    struct no_stale_nodes {};
+    [[no_unique_address]] mutable std::conditional_t<aggregate_node<Node>, stale_nodes, no_stale_nodes> stale;
+
+    // Remember that the value of node may be changed (see stale). Returns
+    // node.
+    Node *touch(Node *node);
+
+    // Update the aggregates on the paths from the stale nodes to the root.
+    void refresh() const;
+
     using search_t = std::pair<Node*, char>;
 
     // Find a node for a specified key.
@@ -55,27 +190,169 @@ private:
     // If key is not present, first value is a ptr to a node that the node with
     // this key would be a child of and the second one is -1 if the new node
     // would be a left child and 1 if it would be a right child.
-    search_t search_by_key(const kT &key) const;
-
-    // Insert a new node with item as a child of parent (right child if right is
-    // true, left otherwise). The parent node must not have this child.
+    // K is either kT or any other type if the comparator is transparent.
+    template <typename K>
+    search_t search_by_key(const K &key) const;
+
+    // Same as search_by_key, but only in the subtree of node (the key must be
+    // within the range of keys of the subtree).
+    template <typename K>
+    search_t search_subtree(Node *node, const K &key) const;
+
+    // Same as search_by_key, but the search starts from the node start (if
+    // it is not null) and goes up only as far as needed, so it takes
+    // O(log d) steps for a key d positions away from it. A key greater than
+    // all the others is found next to max_node in O(1).
+    template <typename K>
+    search_t search_near(Node *start, const K &key) const;
+
+    // The first node with key not less than (greater than for upper_bound)
+    // the specified one or nullptr if there is none.
+    template <typename K>
+    Node *lower_bound_node(const K &key) const;
+    template <typename K>
+    Node *upper_bound_node(const K &key) const;
+
+    // Insert a new node as a child of parent (right child if right is true,
+    // left otherwise). The key of the node is constructed from key and the
+    // value - from args. The parent node must not have this child.
     // If parent is null, new node with null parent is created and assigned to
     // this->root.
     // Returns a ptr to created Node.
-    Node *insert_at(
-        Node *parent, const bool right, const std::pair<kT,vT> &item);
+    template <typename K, typename... Args>
+    Node *insert_at(Node *parent, const bool right, K &&key, Args&&... args);
     
     // Utility overload. Should only be called if s.second != 0.
-    Node *insert_at(search_t s, const std::pair<kT,vT> &item)
+    template <typename K, typename... Args>
+    Node *insert_at(search_t s, K &&key, Args&&... args)
     {
-        return this->insert_at(s.first, (s.second == 1), item);
+        return this->insert_at(s.first, (s.second == 1),
+            std::forward<K>(key), std::forward<Args>(args)...);
     }
 
+    // Implementation of try_emplace and insert_or_assign for both kinds of
+    // references to the key. The search starts from hint (see search_near).
+    template <typename K, typename... Args>
+    std::pair<Node*, bool> emplace_key(Node *hint, K &&key, Args&&... args);
+    template <typename K, typename M>
+    std::pair<Node*, bool> assign_key(Node *hint, K &&key, M &&obj);
+
+    // Node to start the search from for an insert with a hint (the node of
+    // an iterator close to the key).
+    Node *hint_node(const Node *hint) const;
+
     // Delete a node (not null).
     void delete_at(Node* node);
 
-    // Utility method for recusively getting the depth of the tree.
-    std::size_t node_depth(Node *node) const;
+    // Call update() (if Node has one) on the node and all its ancestors.
+    static void update_path(Node *node);
+
+    // Recursively build a perfectly balanced subtree of size n from the
+    // items starting at first (must be sorted by key without duplicates),
+    // allocating the nodes with alloc. depth is the depth of the subtree
+    // root and height is the depth of the whole tree being built. While
+    // forks is positive, left subtrees are built on other threads (with
+    // their own allocators, which alloc shares then).
+    template <typename RandomIt>
+    Node *build_node(Alloc &alloc, RandomIt first, std::size_t n, Node *parent,
+        std::size_t depth, std::size_t height, unsigned forks);
+
+    // the minimal number of items in a subtree built on another thread
+    static constexpr std::size_t PARALLEL_MIN_BUILD = 1 << 14;
+
+    // Build the tree from a range that is sorted by key without duplicates
+    // (see build_node). The tree must be empty.
+    template <typename RandomIt>
+    void build(RandomIt first, RandomIt last, unsigned forks = 0);
+
+    // Implementation of assign (and parallel_assign if forks is positive).
+    void assign_items(std::vector<std::pair<kT, vT>> &&items, unsigned forks);
+
+    // Destroy all the nodes of the tree without rebalancing. Does not
+    // allocate and does not use recursion.
+    void destroy_all();
+
+    // Destroy all the nodes of the detached subtree of node (see
+    // destroy_all); their memory is returned to the allocator if recycle is
+    // true (otherwise it is left to release()). Returns the number of nodes.
+    std::size_t destroy_subtree(Node *node, bool recycle);
+
+    // Number of nodes in the smaller of the detached trees of a and b (which
+    // may be null) and whether it is the tree of a. O(1) for sized Nodes,
+    // otherwise both trees are walked in lockstep until the smaller one
+    // ends, which takes O(log n + m) steps for its size m.
+    static std::pair<std::size_t, bool> count_smaller(const Node *a, const Node *b);
+
+    // Utilities for join-based operations. Subtrees passed to them must be
+    // detached (have no parent) and are consumed; returned ones are detached.
+
+    // the minimal height of subtrees worth processing on another thread
+    static constexpr std::uint32_t PARALLEL_MIN_HEIGHT = 12;
+
+    // Detach and return the children of node.
+    static std::pair<Node*, Node*> detach_children(Node *node);
+
+    // Subtree split by a key: the trees of the nodes with smaller and greater
+    // keys and the (detached) node with the key, if there is one.
+    struct split_t
+    {
+        Node *less;
+        Node *equal;
+        Node *greater;
+    };
+
+    split_t split_node(Node *node, const kT &key) const requires joinable_node<Node>;
+
+    // Join two trees with all the keys of less less than all the keys of
+    // greater (without a node between them, see Node::join).
+    static Node *join_nodes(Node *less, Node *greater) requires joinable_node<Node>;
+
+    // Take the node with the greatest key out of the tree of node.
+    static Node *take_last(Node *node, Node *&last) requires joinable_node<Node>;
+
+    // Set operations on the trees of a and b (see set_union etc.). Nodes that
+    // do not get to the result are added to discarded (as roots of detached
+    // subtrees). Recursive calls for the independent halves are forked
+    // while forks is positive (see "fork_join.h").
+    Node *union_nodes(Node *a, Node *b, std::vector<Node*> &discarded, unsigned forks) const
+        requires joinable_node<Node>;
+    Node *intersection_nodes(Node *a, Node *b, std::vector<Node*> &discarded, unsigned forks) const
+        requires joinable_node<Node>;
+    Node *difference_nodes(Node *a, Node *b, std::vector<Node*> &discarded, unsigned forks) const
+        requires joinable_node<Node>;
+
+    using set_operation_t = Node *(BaseTree<kT, vT, Node, Compare, Alloc>::*)(Node*, Node*,
+        std::vector<Node*>&, unsigned) const;
+
+    // Run operation on the pairs of the smaller and the greater halves,
+    // forking if both pairs are large enough.
+    void recurse(set_operation_t operation, Node *a_less, Node *b_less, Node *&less,
+        Node *a_greater, Node *b_greater, Node *&greater, std::vector<Node*> &discarded,
+        unsigned forks) const;
+
+    // Replace the tree with the result of operation on it and other (which is
+    // left empty).
+    void set_operation(BaseTree<kT, vT, Node, Compare, Alloc> &&other, set_operation_t operation);
+
+    // Utilities for in-order navigation (N is either Node or const Node).
+    template <class N>
+    static N *leftmost(N *node);
+    template <class N>
+    static N *rightmost(N *node);
+    template <class N>
+    static N *successor(N *node);
+    template <class N>
+    static N *predecessor(N *node);
+
+    // Number of nodes in the subtree of node (which may be null).
+    static std::size_t count_nodes(const Node *node) requires sized_node<Node>;
+
+    // Number of nodes with keys less than key (or not greater than key, if
+    // inclusive).
+    std::size_t count_below(const kT &key, bool inclusive) const requires sized_node<Node>;
+
+    // The node with k nodes before it in order or nullptr if k >= size().
+    Node *select_node(std::size_t k) const requires sized_node<Node>;
 
     // Utility for crearing/printing the tree.
     // Traverses the tree in top-to-bottom left-to-right order and applies func
@@ -84,33 +361,359 @@ private:
 
 public:
 
-    BaseTree();
+    using key_type = kT;
+    using mapped_type = vT;
+
+    // Bidirectional iterator that visits the nodes in the order of keys.
+    // It only follows the links of the nodes, so iteration does not allocate.
+    // Dereferencing gives a pair of references to the key and the value (a
+    // const one for Nodes that aggregate the values, see aggregate_node; use
+    // insert_or_assign with the iterator as a hint to change them).
+    // Erasing a node only invalidates iterators to that node.
+    template <bool Const>
+    class tree_iterator
+    {
+    private:
 
-    BaseTree(const BaseTree<kT, vT, Node> &other);
-    BaseTree<kT, vT, Node> &operator=(const BaseTree<kT, vT, Node> &other);
+        friend class BaseTree<kT, vT, Node, Compare, Alloc>;
+        friend class tree_iterator<!Const>;
 
-    BaseTree(BaseTree<kT, vT, Node> &&other);
-    BaseTree<kT, vT, Node> &operator=(BaseTree<kT, vT, Node> &&other);
+        using node_t = std::conditional_t<Const, const Node, Node>;
 
-    ~BaseTree();
+        node_t *node;
+        // needed to step back from end()
+        const BaseTree<kT, vT, Node, Compare, Alloc> *tree;
 
-public:
+        tree_iterator(node_t *_node, const BaseTree<kT, vT, Node, Compare, Alloc> *_tree):
+            node(_node),
+            tree(_tree)
+        {}
+
+    public:
+
+        using iterator_category = std::bidirectional_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::pair<const kT, vT>;
+        using reference = std::pair<const kT&, std::conditional_t<Const || aggregate_node<Node>, const vT&, vT&>>;
+
+        // operator-> has to return something that holds the pair of references
+        struct pointer
+        {
+            reference ref;
+            const reference *operator->() const { return &this->ref; }
+        };
+
+        tree_iterator(): node(nullptr), tree(nullptr) {}
 
-    vT& operator[](const kT &key) override;
+        // iterator is convertible to const_iterator
+        template <bool OtherConst>
+        tree_iterator(const tree_iterator<OtherConst> &other) requires (Const && !OtherConst):
+            node(other.node),
+            tree(other.tree)
+        {}
 
-    bool insert(const kT &key, const vT &value) override;
+        reference operator*() const { return reference(this->node->key, this->node->value); }
 
-    bool find(const kT &key, vT &dst) const override;
+        pointer operator->() const { return pointer{ **this }; }
 
-    bool contains(const kT &key) const override;
+        tree_iterator &operator++()
+        {
+            this->node = BaseTree<kT, vT, Node, Compare, Alloc>::successor(this->node);
+            return *this;
+        }
+
+        tree_iterator operator++(int)
+        {
+            tree_iterator copy = *this;
+            ++(*this);
+            return copy;
+        }
+
+        tree_iterator &operator--()
+        {
+            this->node = this->node == nullptr ?
+                BaseTree<kT, vT, Node, Compare, Alloc>::rightmost<node_t>(this->tree->root) :
+                BaseTree<kT, vT, Node, Compare, Alloc>::predecessor(this->node);
+            return *this;
+        }
+
+        tree_iterator operator--(int)
+        {
+            tree_iterator copy = *this;
+            --(*this);
+            return copy;
+        }
+
+        friend bool operator==(const tree_iterator &a, const tree_iterator &b)
+        {
+            return a.node == b.node;
+        }
+    };
+
+    using iterator = tree_iterator<false>;
+    using const_iterator = tree_iterator<true>;
+
+    BaseTree();
+
+    explicit BaseTree(const Compare &_comp);
+
+    // Construct a tree from the items (pairs of key and value) in
+    // [first, last). See assign.
+    template <typename InputIt>
+    BaseTree(InputIt first, InputIt last, const Compare &_comp = Compare());
+
+    explicit BaseTree(std::vector<std::pair<kT, vT>> &&items, const Compare &_comp = Compare());
 
-    std::size_t size() const override { return this->_size; };
+    BaseTree(const BaseTree<kT, vT, Node, Compare, Alloc> &other);
+    BaseTree<kT, vT, Node, Compare, Alloc> &operator=(const BaseTree<kT, vT, Node, Compare, Alloc> &other);
 
-    bool erase(const kT &key) override;
+    BaseTree(BaseTree<kT, vT, Node, Compare, Alloc> &&other);
+    BaseTree<kT, vT, Node, Compare, Alloc> &operator=(BaseTree<kT, vT, Node, Compare, Alloc> &&other);
 
-    void clear() override;
+    ~BaseTree();
+
+public:
 
-    std::size_t depth() const override { return this->node_depth(this->root); }
+    vT& operator[](const kT &key);
+    vT& operator[](kT &&key);
+
+    bool insert(const kT &key, const vT &value);
+    bool insert(kT &&key, vT &&value);
+
+    // If the key is absent, insert a node with the value constructed in place
+    // from args; otherwise do nothing (args are not used).
+    // Returns an iterator to the node with the key and true if it has been
+    // inserted.
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const kT &key, Args&&... args);
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(kT &&key, Args&&... args);
+
+    // Same as try_emplace, but the key may be constructed from any type.
+    template <typename K, typename... Args>
+    std::pair<iterator, bool> emplace(K &&key, Args&&... args);
+
+    // Insert a new node or assign obj to the value of the existing one.
+    // Returns an iterator to the node with the key and true if it has been
+    // inserted.
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(const kT &key, M &&obj);
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(kT &&key, M &&obj);
+
+    // Same as above, but the place of the key is looked for starting from
+    // hint, which should point to a node with a key close to it (or be
+    // end() for the greatest keys): an insert next to the hint takes
+    // amortized O(1) steps plus rebalancing. Without a hint, the search
+    // starts from the last inserted node, and keys greater than all the
+    // others are always inserted in O(1), so increasing keys (e.g.
+    // timestamps) do not need one.
+    // Returns an iterator to the node with the key.
+    template <typename... Args>
+    iterator try_emplace(const_iterator hint, const kT &key, Args&&... args);
+    template <typename... Args>
+    iterator try_emplace(const_iterator hint, kT &&key, Args&&... args);
+
+    template <typename M>
+    iterator insert_or_assign(const_iterator hint, const kT &key, M &&obj);
+    template <typename M>
+    iterator insert_or_assign(const_iterator hint, kT &&key, M &&obj);
+
+    bool find(const kT &key, vT &dst) const;
+
+    const vT *lookup(const kT &key) const;
+    vT *lookup(const kT &key);
+
+    // Lookup a specific key and call fn with a const reference to the value
+    // if it is found.
+    // Returns true if the key exists in the tree.
+    template <typename F>
+    bool find_and(const kT &key, F &&fn) const;
+
+    // Iterator to the node with the given key or end() if there is none.
+    iterator find(const kT &key);
+    const_iterator find(const kT &key) const;
+
+    // Lookup all the keys at once: out[i] is set to the pointer to the value
+    // of keys[i] (as returned by lookup). The searches go down the tree in
+    // lockstep, in groups of BATCH_GROUP keys, and every next node is
+    // prefetched while the other searches of the group advance, so the
+    // cache misses of different keys overlap.
+    // out must be at least as long as keys. Returns the number of keys found.
+    std::size_t find_batch(std::span<const kT> keys, std::span<const vT*> out) const;
+
+    // Same as find_batch, but for keys sorted in ascending order: the search
+    // for every key starts from the node where the previous one ended,
+    // going up through parent links only as far as needed, so a batch of k
+    // keys takes O(k log(n / k)) steps instead of O(k log n). Keys out of
+    // order are still found (by a search from the root).
+    std::size_t find_sorted_batch(std::span<const kT> keys, std::span<const vT*> out) const;
+
+    // Coroutine version of lookup: prefetches every next node and suspends
+    // before visiting it (see "interleave.h" for how to run many of them).
+    // The key must outlive the task.
+    lookup_task<const vT*> lookup_coro(const kT &key) const;
+
+    // Heterogeneous lookup: overloads of the methods above that accept any
+    // key type the (transparent) comparator can compare with kT, without
+    // constructing a kT.
+    template <typename K> requires lookup_key<Compare, K, kT>
+    bool contains(const K &key) const { return this->search_by_key(key).second == 0; }
+
+    template <typename K> requires lookup_key<Compare, K, kT>
+    const vT *lookup(const K &key) const;
+    template <typename K> requires lookup_key<Compare, K, kT>
+    vT *lookup(const K &key);
+
+    template <typename K, typename F> requires lookup_key<Compare, K, kT>
+    bool find_and(const K &key, F &&fn) const;
+
+    template <typename K> requires lookup_key<Compare, K, kT>
+    iterator find(const K &key);
+    template <typename K> requires lookup_key<Compare, K, kT>
+    const_iterator find(const K &key) const;
+
+    bool contains(const kT &key) const;
+
+    std::size_t size() const { return this->_size; };
+
+    bool erase(const kT &key);
+
+    void clear();
+
+    std::size_t depth() const;
+
+    // Computed in a single pass over the tree without recursion.
+    tree_shape shape() const;
+
+    // Immutable copy of the tree laid out for fast lookups (see
+    // "frozen_tree.h").
+    FrozenTree<kT, vT, Compare> freeze() const { return FrozenTree<kT, vT, Compare>(this->begin(), this->end(), this->comp); }
+
+    iterator begin() { return iterator(leftmost(this->root), this); }
+    const_iterator begin() const { return const_iterator(leftmost<const Node>(this->root), this); }
+    const_iterator cbegin() const { return this->begin(); }
+
+    iterator end() { return iterator(nullptr, this); }
+    const_iterator end() const { return const_iterator(nullptr, this); }
+    const_iterator cend() const { return this->end(); }
+
+    // Iterator to the first node with key not less than the given one.
+    iterator lower_bound(const kT &key) { return iterator(this->lower_bound_node(key), this); }
+    const_iterator lower_bound(const kT &key) const { return const_iterator(this->lower_bound_node(key), this); }
+
+    // Iterator to the first node with key greater than the given one.
+    iterator upper_bound(const kT &key) { return iterator(this->upper_bound_node(key), this); }
+    const_iterator upper_bound(const kT &key) const { return const_iterator(this->upper_bound_node(key), this); }
+
+    // Range of nodes with the given key (which is either empty or contains
+    // exactly one node).
+    std::pair<iterator, iterator> equal_range(const kT &key);
+    std::pair<const_iterator, const_iterator> equal_range(const kT &key) const;
+
+    // Heterogeneous versions of the above (see find).
+    template <typename K> requires lookup_key<Compare, K, kT>
+    iterator lower_bound(const K &key) { return iterator(this->lower_bound_node(key), this); }
+    template <typename K> requires lookup_key<Compare, K, kT>
+    const_iterator lower_bound(const K &key) const { return const_iterator(this->lower_bound_node(key), this); }
+
+    template <typename K> requires lookup_key<Compare, K, kT>
+    iterator upper_bound(const K &key) { return iterator(this->upper_bound_node(key), this); }
+    template <typename K> requires lookup_key<Compare, K, kT>
+    const_iterator upper_bound(const K &key) const { return const_iterator(this->upper_bound_node(key), this); }
+
+    // Order statistics, for Nodes that count the nodes of their subtrees
+    // (e.g. RBTree<kT, vT, Compare, subtree_size>, see "augment.h"). All of
+    // them are O(log n).
+
+    // Number of keys less than the given one (its position in order, if it
+    // is present).
+    std::size_t rank(const kT &key) const requires sized_node<Node> { return this->count_below(key, false); }
+
+    // Iterator to the node at the position k in order (starting with 0) or
+    // end() if k >= size().
+    iterator select(std::size_t k) requires sized_node<Node> { return iterator(this->select_node(k), this); }
+    const_iterator select(std::size_t k) const requires sized_node<Node> { return const_iterator(this->select_node(k), this); }
+
+    // Number of keys in [lo, hi].
+    std::size_t count_range(const kT &lo, const kT &hi) const requires sized_node<Node>;
+
+    // Aggregate (e.g. the sum of values) of the items with keys in [lo, hi],
+    // for Nodes that aggregate the items of their subtrees (e.g.
+    // RBTree<kT, vT, Compare, aggregate<value_sum<vT>>>, see "augment.h").
+    // O(log n). Values changed through the references from operator[] and
+    // lookup are taken into account too: the tree remembers the nodes it gave
+    // them out for and updates their paths to the root before the next
+    // aggregate (or erase, split etc.), which adds O(log n) per such node.
+    // For these Nodes, operator[] and lookup (non-const) count as writes.
+    auto aggregate(const kT &lo, const kT &hi) const requires aggregate_node<Node>;
+
+    // Call fn(key, value) for every item whose key (an interval) has common
+    // points with [lo, hi], in order of keys; for Nodes with interval keys
+    // (e.g. IntervalTree, see "interval_tree.h"). Subtrees where all the
+    // intervals end before lo are skipped and the walk stops at the first
+    // interval starting after hi, so every subtree it enters holds one of
+    // the k intervals found (or the last one it visits): it takes
+    // O(min(n, (k + 1) log n)) steps. Nodes not found are visited too, so
+    // this is not O(log n + k) (e.g. when the intervals found are scattered
+    // among many short ones that end before lo).
+    template <typename P, typename F> requires interval_node<Node>
+    void for_each_overlapping(const P &lo, const P &hi, F &&fn) const;
+
+    // Join-based operations, for Nodes that can join trees (e.g. RBTree, see
+    // joinable_node) and allocators that can share Nodes between trees (see
+    // "node_pool.h"). Nodes are moved between the trees without copying.
+    //
+    // Memory: with NodePool, the trees that exchanged Nodes co-own all the
+    // slabs of each other, and a slab is freed only when every tree that owns
+    // it is cleared or destroyed. Nodes of a tree that is cleared leave holes
+    // in the shared slabs that the other trees do not reuse (each tree only
+    // reuses the Nodes it destroyed itself). E.g. after a split, destroying
+    // one of the trees frees no memory, and a tree that keeps splitting off
+    // and dropping parts of itself keeps all of its slabs. Copy the tree
+    // (which gets fresh slabs) to give the memory back.
+
+    // Move all the items of greater (whose keys must be greater than all the
+    // keys of this tree) to this tree. O(log n).
+    void join(BaseTree<kT, vT, Node, Compare, Alloc> &&greater)
+        requires joinable_node<Node> && shared_allocator<Alloc>;
+
+    // Move the items with keys not less than key to the returned tree.
+    // O(log n) for Nodes that count the nodes of their subtrees (see
+    // sized_node, e.g. RBTree<kT, vT, Compare, subtree_size>). Otherwise the
+    // items of the smaller of the two trees are counted, which takes
+    // O(log n + m) for m of them (e.g. on the default RBTree). Both trees
+    // own the slabs of the Nodes unless one of them is empty (see above).
+    BaseTree<kT, vT, Node, Compare, Alloc> split(const kT &key)
+        requires joinable_node<Node> && shared_allocator<Alloc>;
+
+    // Set operations: the tree gets the items with keys in either of the trees
+    // (union), in both of them (intersection) or only in this one
+    // (difference); for keys in both trees, the values of this one are kept.
+    // other is left empty. They take O(m log(n / m + 1)) steps for the trees
+    // of sizes m <= n, independent subtrees are processed in parallel.
+    void set_union(BaseTree<kT, vT, Node, Compare, Alloc> &&other)
+        requires joinable_node<Node> && shared_allocator<Alloc>;
+    void set_intersection(BaseTree<kT, vT, Node, Compare, Alloc> &&other)
+        requires joinable_node<Node> && shared_allocator<Alloc>;
+    void set_difference(BaseTree<kT, vT, Node, Compare, Alloc> &&other)
+        requires joinable_node<Node> && shared_allocator<Alloc>;
+
+    // Replace the contents of the tree with the items (pairs of key and value)
+    // in [first, last). If the items are sorted by key, the tree is built in
+    // O(n) without rebalancing, otherwise they are sorted first. For equal
+    // keys, the last item wins (as if they were inserted one by one).
+    template <typename InputIt>
+    void assign(InputIt first, InputIt last);
+
+    // Same as above, but uses the vector as a buffer for sorting, so it does
+    // not have to copy the items.
+    void assign(std::vector<std::pair<kT, vT>> &&items);
+
+    // Same as above, but the items are sorted and the tree is built on all the
+    // cores (see "fork_join.h"). Every thread allocates its own nodes, so the
+    // allocator must be able to share them (see "node_pool.h").
+    void parallel_assign(std::vector<std::pair<kT, vT>> &&items) requires shared_allocator<Alloc>;
 
 #if defined _TREE_DEBUG && _TREE_DEBUG > 0
     // node printing is defined in the node class to allow for printing extra
@@ -122,56 +725,116 @@ public:
 
 // Constructors
 
-template <typename kT, typename vT, class Node>
-BaseTree<kT, vT, Node>::BaseTree():
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc>::BaseTree():
+    comp(),
     root(nullptr),
-    _size(0)
+    _size(0),
+    finger(nullptr),
+    max_node(nullptr)
 {
     LOG("Tree constructed (default).");
 };
 
-template <typename kT, typename vT, class Node>
-BaseTree<kT, vT, Node>::BaseTree(const BaseTree<kT, vT, Node> &other)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc>::BaseTree(const Compare &_comp):
+    comp(_comp),
+    root(nullptr),
+    _size(0),
+    finger(nullptr),
+    max_node(nullptr)
+{
+    LOG("Tree constructed (comparator).");
+};
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename InputIt>
+BaseTree<kT, vT, Node, Compare, Alloc>::BaseTree(InputIt first, InputIt last, const Compare &_comp):
+    comp(_comp),
+    root(nullptr),
+    _size(0),
+    finger(nullptr),
+    max_node(nullptr)
 {
-    this->root = this->copy_node(other.root, nullptr);
-    this->_size = other._size;
+    this->assign(first, last);
+    LOG("Tree constructed (range).");
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc>::BaseTree(std::vector<std::pair<kT, vT>> &&items, const Compare &_comp):
+    comp(_comp),
+    root(nullptr),
+    _size(0),
+    finger(nullptr),
+    max_node(nullptr)
+{
+    this->assign(std::move(items));
+    LOG("Tree constructed (vector).");
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc>::BaseTree(const BaseTree<kT, vT, Node, Compare, Alloc> &other):
+    comp(other.comp),
+    alloc()
+{
+    this->root = nullptr;
+    this->finger = nullptr;
+    this->copy_from(other);
     LOG("Tree constructed (copy).");
 };
 
-template <typename kT, typename vT, class Node>
-BaseTree<kT, vT, Node> &BaseTree<kT, vT, Node>::operator=(const BaseTree<kT, vT, Node> &other)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc> &BaseTree<kT, vT, Node, Compare, Alloc>::operator=(const BaseTree<kT, vT, Node, Compare, Alloc> &other)
 {
+    if (this == &other)
+    {
+        return *this;
+    }
     this->clear();
-    this->root = this->copy_node(other.root, nullptr);
-    this->_size = other._size;
+    this->comp = other.comp;
+    this->copy_from(other);
     LOG("Tree assigned (copy).");
     return *this;
 }
 
-template <typename kT, typename vT, class Node>
-BaseTree<kT, vT, Node>::BaseTree(BaseTree<kT, vT, Node> &&other)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc>::BaseTree(BaseTree<kT, vT, Node, Compare, Alloc> &&other):
+    comp(std::move(other.comp)),
+    alloc(std::move(other.alloc))
 {
     this->root = other.root;
     other.root = nullptr;
     this->_size = other._size;
     other._size = 0;
+    this->finger = std::exchange(other.finger, nullptr);
+    this->max_node = std::exchange(other.max_node, nullptr);
+    this->stale = std::move(other.stale);
     LOG("Tree constructed (move).");
 };
 
-template <typename kT, typename vT, class Node>
-BaseTree<kT, vT, Node> &BaseTree<kT, vT, Node>::operator=(BaseTree<kT, vT, Node> &&other)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc> &BaseTree<kT, vT, Node, Compare, Alloc>::operator=(BaseTree<kT, vT, Node, Compare, Alloc> &&other)
 {
+    if (this == &other)
+    {
+        return *this;
+    }
     this->clear();
+    this->comp = std::move(other.comp);
+    this->alloc = std::move(other.alloc);
     this->root = other.root;
     other.root = nullptr;
     this->_size = other._size;
     other._size = 0;
+    this->finger = std::exchange(other.finger, nullptr);
+    this->max_node = std::exchange(other.max_node, nullptr);
+    this->stale = std::move(other.stale);
     LOG("Tree assigned (move).");
     return *this;
 }
 
-template <typename kT, typename vT, class Node>
-BaseTree<kT, vT, Node>::~BaseTree()
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc>::~BaseTree()
 {
     this->clear();
 }
@@ -179,60 +842,307 @@ BaseTree<kT, vT, Node>::~BaseTree()
 
 // Utils
 
-template <typename kT, typename vT, class Node>
-Node *BaseTree<kT, vT, Node>::copy_node(Node *other, Node *parent)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::copy_node(Alloc &alloc, const Node *other, Node *parent,
+    std::size_t n, unsigned forks)
 {
     if (other == nullptr)
     {
         LOGV("other is null");
         return nullptr;
     }
-    LOGV("copying " << other->key);
 
-    Node *copied = new Node(*other);
-    LOG("[ MEMORY ] Created Node using new.");
+    auto size_hint = [](const Node *node) -> std::size_t
+    {
+        if constexpr (sized_node<Node>)
+        {
+            return node == nullptr ? 0 : node->augment.size;
+        }
+        else
+        {
+            return 0;
+        }
+    };
+    auto large = [](const Node *node)
+    {
+        if constexpr (requires { node->height; })
+        {
+            return node != nullptr && node->height >= PARALLEL_MIN_HEIGHT;
+        }
+        else
+        {
+            return false;
+        }
+    };
+
+    if constexpr (shared_allocator<Alloc>)
+    {
+        if (forks > 0 && large(other->left) && large(other->right))
+        {
+            LOGV("forking at " << other->key);
+            Node *copied = alloc.create(*other);
+            copied->parent = parent;
+            Alloc forked_alloc;
+            fork_join(true,
+                [&]() { copied->left = this->copy_node(forked_alloc, other->left, copied, size_hint(other->left), forks - 1); },
+                [&]() { copied->right = this->copy_node(alloc, other->right, copied, size_hint(other->right), forks - 1); });
+            alloc.share(forked_alloc);
+            return copied;
+        }
+    }
+
+    if constexpr (requires { alloc.reserve(n); })
+    {
+        if (n == 0)
+        {
+            // size of a forked subtree of Nodes that do not count their
+            // subtrees: it is counted here, on the thread that copies it
+            std::vector<const Node*> pending{ other };
+            while (!pending.empty())
+            {
+                const Node *node = pending.back();
+                pending.pop_back();
+                n++;
+                for (const Node *child : { node->left, node->right })
+                {
+                    if (child != nullptr)
+                    {
+                        pending.push_back(child);
+                    }
+                }
+            }
+        }
+        alloc.reserve(n);
+    }
+
+    // src is copied to dst, then its left child (if any) is copied next, and
+    // its right child waits on the stack with the copy of its parent
+    Node *copied = alloc.create(*other);
     copied->parent = parent;
-    LOGV("going left");
-    copied->left = this->copy_node(other->left, copied);
-    LOGV("going right");
-    copied->right = this->copy_node(other->right, copied);
+    std::vector<std::pair<const Node*, Node*>> pending;
+    const Node *src = other;
+    Node *dst = copied;
+    while (true)
+    {
+        if (src->right != nullptr)
+        {
+            pending.emplace_back(src->right, dst);
+        }
+        if (src->left != nullptr)
+        {
+            dst->left = alloc.create(*src->left);
+            dst->left->parent = dst;
+            src = src->left;
+            dst = dst->left;
+            continue;
+        }
+        if (pending.empty())
+        {
+            break;
+        }
+        std::tie(src, dst) = pending.back();
+        pending.pop_back();
+        dst->right = alloc.create(*src);
+        dst->right->parent = dst;
+        dst = dst->right;
+    }
 
     return copied;
 }
 
-template <typename kT, typename vT, class Node>
-typename BaseTree<kT, vT, Node>::search_t BaseTree<kT, vT, Node>::search_by_key(const kT &key) const
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::copy_from(const BaseTree<kT, vT, Node, Compare, Alloc> &other)
+{
+    unsigned forks = 0;
+    if constexpr (shared_allocator<Alloc>)
+    {
+        forks = fork_depth();
+    }
+    other.refresh();
+    this->root = this->copy_node(this->alloc, other.root, nullptr, other._size, forks);
+    this->_size = other._size;
+    this->max_node = rightmost(this->root);
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (this->root != nullptr && !this->root->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::search_t BaseTree<kT, vT, Node, Compare, Alloc>::search_by_key(const K &key) const
+{
+    return this->search_subtree(this->root, key);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::search_t BaseTree<kT, vT, Node, Compare, Alloc>::search_subtree(Node *node, const K &key) const
 {
     LOGV("->");
-    Node *current = this->root, *previous = nullptr;
+    Node *current = node, *previous = nullptr;
+    char direction = 1;
 
-    while (current != nullptr && current->key != key)
+    while (current != nullptr)
     {
-        LOGV("going " << (key < current->key ? "left" : "right"));
-        LOGV("search = " << key << ", current = " << current->key);
+        // one (three-way) comparison per level
+        auto order = key_order(this->comp, key, current->key);
+        if (order == 0)
+        {
+            LOGV("<-");
+            return BaseTree<kT, vT, Node, Compare, Alloc>::search_t(current, 0);
+        }
+        LOGV("going " << (order < 0 ? "left" : "right"));
         previous = current;
-        current = (key < current->key) ? current->left : current->right;
+        direction = order < 0 ? -1 : 1;
+        current = order < 0 ? current->left : current->right;
     }
 
-    LOGV("result is " << IS_NULL(current));
     LOGV("<-");
-    if (current == nullptr)
+    return BaseTree<kT, vT, Node, Compare, Alloc>::search_t(previous, direction);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::search_t BaseTree<kT, vT, Node, Compare, Alloc>::search_near(Node *start, const K &key) const
+{
+    if (this->max_node != nullptr && key_less(this->comp, this->max_node->key, key))
+    {
+        // the greatest node has no right child
+        return BaseTree<kT, vT, Node, Compare, Alloc>::search_t(this->max_node, 1);
+    }
+    if (start == nullptr)
+    {
+        return this->search_subtree(this->root, key);
+    }
+
+    // go up until the key is within the range of the subtree: the bound on
+    // the side of the key is the key of the nearest ancestor that has the
+    // subtree on the other side (the other bound holds already, as the key of
+    // start is on that side)
+    Node *node = start;
+    auto order = key_order(this->comp, key, node->key);
+    if (order > 0)
+    {
+        while (node->parent != nullptr &&
+            (node->parent->right == node || !key_less(this->comp, key, node->parent->key)))
+        {
+            node = node->parent;
+        }
+    }
+    else if (order < 0)
+    {
+        while (node->parent != nullptr &&
+            (node->parent->left == node || !key_less(this->comp, node->parent->key, key)))
+        {
+            node = node->parent;
+        }
+    }
+    return this->search_subtree(node, key);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::lower_bound_node(const K &key) const
+{
+    Node *current = this->root, *result = nullptr;
+    while (current != nullptr)
+    {
+        if (key_less(this->comp, current->key, key))
+        {
+            current = current->right;
+        }
+        else
+        {
+            result = current;
+            current = current->left;
+        }
+    }
+    return result;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::upper_bound_node(const K &key) const
+{
+    Node *current = this->root, *result = nullptr;
+    while (current != nullptr)
+    {
+        if (key_less(this->comp, key, current->key))
+        {
+            result = current;
+            current = current->left;
+        }
+        else
+        {
+            current = current->right;
+        }
+    }
+    return result;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::size_t BaseTree<kT, vT, Node, Compare, Alloc>::count_nodes(const Node *node) requires sized_node<Node>
+{
+    return node == nullptr ? 0 : node->augment.size;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::size_t BaseTree<kT, vT, Node, Compare, Alloc>::count_below(const kT &key, bool inclusive) const requires sized_node<Node>
+{
+    // every time the search goes right, the node and its left subtree are
+    // before the key
+    std::size_t result = 0;
+    const Node *current = this->root;
+    while (current != nullptr)
     {
-        if (previous == nullptr)
+        bool before = inclusive ?
+            !key_less(this->comp, key, current->key) :
+            key_less(this->comp, current->key, key);
+        if (before)
+        {
+            result += count_nodes(current->left) + 1;
+            current = current->right;
+        }
+        else
         {
-            return BaseTree<kT, vT, Node>::search_t(nullptr, 1);
+            current = current->left;
         }
-        return BaseTree<kT, vT, Node>::search_t(
-            previous,
-            (key < previous->key) ? -1 : 1
-        );
     }
+    return result;
+}
 
-    return BaseTree<kT, vT, Node>::search_t(current, 0);
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::select_node(std::size_t k) const requires sized_node<Node>
+{
+    Node *current = this->root;
+    while (current != nullptr)
+    {
+        std::size_t left = count_nodes(current->left);
+        if (k == left)
+        {
+            return current;
+        }
+        if (k < left)
+        {
+            current = current->left;
+        }
+        else
+        {
+            k -= left + 1;
+            current = current->right;
+        }
+    }
+    return nullptr;
 }
 
-template <typename kT, typename vT, class Node>
-Node* BaseTree<kT, vT, Node>::insert_at(Node *parent, bool right, const std::pair<kT, vT> &item)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K, typename... Args>
+Node* BaseTree<kT, vT, Node, Compare, Alloc>::insert_at(Node *parent, bool right, K &&key, Args&&... args)
 {
     Node **dst;
 
@@ -245,15 +1155,20 @@ Node* BaseTree<kT, vT, Node>::insert_at(Node *parent, bool right, const std::pai
         dst = &(right ? parent->right : parent->left);
     }
 
-    *dst = new Node(item, parent);
+    *dst = this->alloc.create(parent, std::forward<K>(key), std::forward<Args>(args)...);
     Node* inserted = *dst;
-    LOG("[ MEMORY ] Created Node using new.");
     this->_size++;
+    this->finger = inserted;
+    if (parent == this->max_node && (parent == nullptr || right))
+    {
+        this->max_node = inserted;
+    }
     LOGV("dst: " << (*dst)->key);
     LOGV("dst = " << dst << ", *dst = " << (*dst));
     (*dst)->adjust_insert();
     LOGV("dst: " << (*dst)->key);
     LOGV("dst = " << dst << ", *dst = " << (*dst));
+    this->update_path(inserted);
 
     while(this->root->parent != nullptr)
     {
@@ -270,14 +1185,42 @@ Node* BaseTree<kT, vT, Node>::insert_at(Node *parent, bool right, const std::pai
     return inserted;
 }
 
-template <typename kT, typename vT, class Node>
-void BaseTree<kT, vT, Node>::delete_at(Node *node)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::delete_at(Node *node)
 {
+    // any node that stays in the tree will do to find the new root (this
+    // one might be deleted)
+    Node *anchor = node->parent != nullptr ? node->parent :
+        (node->left != nullptr ? node->left : node->right);
+
+    if (node == this->max_node)
+    {
+        this->max_node = predecessor(node);
+    }
+    if (node == this->finger)
+    {
+        this->finger = nullptr;
+    }
+
+    // the lowest node whose subtree will change: the parent of the node that
+    // is removed from its place (this one or its predecessor)
+    Node *lowest = node->parent;
+    if (node->left != nullptr && node->right != nullptr)
+    {
+        Node *predecessor = rightmost(node->left);
+        lowest = predecessor->parent == node ? predecessor : predecessor->parent;
+    }
+
     node->adjust_delete();
-    delete node;
+    this->alloc.destroy(node);
     this->_size--;
-    LOG("[ MEMORY ] Node deleted.");
+    this->update_path(lowest);
 
+    this->root = anchor;
+    if (this->root == nullptr)
+    {
+        return;
+    }
     while(this->root->parent != nullptr)
     {
         this->root = this->root->parent;
@@ -293,96 +1236,1252 @@ void BaseTree<kT, vT, Node>::delete_at(Node *node)
 #endif
 }
 
-template <typename kT, typename vT, class Node>
-std::size_t BaseTree<kT, vT, Node>::node_depth(Node *node) const
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename RandomIt>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::build_node(Alloc &alloc, RandomIt first, std::size_t n,
+    Node *parent, std::size_t depth, std::size_t height, unsigned forks)
 {
-    if (node == nullptr)
+    if (n == 0)
     {
-        return 0;
+        return nullptr;
+    }
+
+    // the middle item goes to the root, so the sizes of subtrees differ by
+    // at most 1 and all the leaves are on the last two levels
+    std::size_t mid = n / 2;
+    auto &&item = first[mid];
+    Node *node = alloc.create(parent,
+        std::forward<decltype(item)>(item).first,
+        std::forward<decltype(item)>(item).second);
+
+    bool forked = false;
+    if constexpr (shared_allocator<Alloc>)
+    {
+        if (forks > 0 && n >= PARALLEL_MIN_BUILD)
+        {
+            Alloc forked_alloc;
+            fork_join(true,
+                [&]() { node->left = this->build_node(forked_alloc, first, mid, node, depth + 1, height, forks - 1); },
+                [&]() { node->right = this->build_node(alloc, first + mid + 1, n - mid - 1, node, depth + 1, height, forks - 1); });
+            alloc.share(forked_alloc);
+            forked = true;
+        }
+    }
+    if (!forked)
+    {
+        node->left = this->build_node(alloc, first, mid, node, depth + 1, height, 0);
+        node->right = this->build_node(alloc, first + mid + 1, n - mid - 1, node, depth + 1, height, 0);
+    }
+    node->adjust_build(depth, height);
+    if constexpr (requires { node->update(); })
+    {
+        node->update();
     }
-    std::size_t left_d = this->node_depth(node->left), right_d = this->node_depth(node->right);
-    return 1 + (left_d > right_d ? left_d : right_d);
+    return node;
 }
 
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename RandomIt>
+void BaseTree<kT, vT, Node, Compare, Alloc>::build(RandomIt first, RandomIt last, unsigned forks)
+{
+    std::size_t n = last - first;
+    this->root = this->build_node(this->alloc, first, n, nullptr, 1, std::bit_width(n), forks);
+    this->_size = n;
+    this->max_node = rightmost(this->root);
 
-// Main methods (of the kVTree interface)
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (this->root != nullptr && !this->root->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+}
 
-template <typename kT, typename vT, class Node>
-vT& BaseTree<kT, vT, Node>::operator[](const kT &key)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <class N>
+N *BaseTree<kT, vT, Node, Compare, Alloc>::leftmost(N *node)
 {
-    BaseTree<kT, vT, Node>::search_t search = this->search_by_key(key);
-    Node *node = search.first;
+    if (node != nullptr)
+    {
+        while (node->left != nullptr)
+        {
+            node = node->left;
+        }
+    }
+    return node;
+}
 
-    if (search.second != 0)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <class N>
+N *BaseTree<kT, vT, Node, Compare, Alloc>::rightmost(N *node)
+{
+    if (node != nullptr)
     {
-        LOGV("inserting default value");
-        node = this->insert_at(search, { key, vT{} });
+        while (node->right != nullptr)
+        {
+            node = node->right;
+        }
     }
+    return node;
+}
 
-    return node->value;
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <class N>
+N *BaseTree<kT, vT, Node, Compare, Alloc>::successor(N *node)
+{
+    if (node->right != nullptr)
+    {
+        return leftmost<N>(node->right);
+    }
+    // go up until we come from the left subtree
+    N *parent = node->parent;
+    while (parent != nullptr && parent->right == node)
+    {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
 }
 
-template <typename kT, typename vT, class Node>
-bool BaseTree<kT, vT, Node>::insert(const kT &key, const vT &value)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <class N>
+N *BaseTree<kT, vT, Node, Compare, Alloc>::predecessor(N *node)
 {
-    LOGV("->");
-    BaseTree<kT, vT, Node>::search_t search = this->search_by_key(key);
-    if (search.second == 0)
+    if (node->left != nullptr)
     {
-        // key already exists - just replace the value
-        search.first->value = value;
-        LOGV("<-");
-        return false;
+        return rightmost<N>(node->left);
     }
-    this->insert_at(search, { key, value });
-    LOGV("<-");
-    return true;
+    // go up until we come from the right subtree
+    N *parent = node->parent;
+    while (parent != nullptr && parent->left == node)
+    {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
 }
 
-template <typename kT, typename vT, class Node>
-bool BaseTree<kT, vT, Node>::find(const kT &key, vT& dst) const
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::update_path(Node *node)
 {
-    BaseTree<kT, vT, Node>::search_t search = this->search_by_key(key);
-    if (search.second != 0)
+    if constexpr (requires { node->update(); })
     {
-        return false;
+        for (; node != nullptr; node = node->parent)
+        {
+            node->update();
+        }
     }
-    dst = search.first->value;
-    return true;
 }
 
-template <typename kT, typename vT, class Node>
-bool BaseTree<kT, vT, Node>::contains(const kT &key) const
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::touch(Node *node)
 {
-    return this->search_by_key(key).second == 0;
+    if constexpr (aggregate_node<Node>)
+    {
+        std::vector<Node*> &nodes = this->stale.nodes;
+        if (nodes.empty() || nodes.back() != node)
+        {
+            // repeated writes would make the list grow without bound
+            if (nodes.size() >= this->_size)
+            {
+                this->refresh();
+            }
+            nodes.push_back(node);
+            this->stale.any.store(true, std::memory_order_relaxed);
+        }
+    }
+    return node;
 }
 
-template <typename kT, typename vT, class Node>
-bool BaseTree<kT, vT, Node>::erase(const kT &key)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::refresh() const
 {
-    BaseTree<kT, vT, Node>::search_t search = this->search_by_key(key);
-    if (search.second == 0)
+    if constexpr (aggregate_node<Node>)
     {
-        this->delete_at(search.first);
-        return true;
+        if (!this->stale.any.load(std::memory_order_acquire))
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(this->stale.lock);
+        if (this->stale.any.load(std::memory_order_relaxed))
+        {
+            for (Node *node : this->stale.nodes)
+            {
+                update_path(node);
+            }
+            this->stale.nodes.clear();
+            this->stale.any.store(false, std::memory_order_release);
+        }
     }
-    return false;
 }
 
-template <typename kT, typename vT, class Node>
-void BaseTree<kT, vT, Node>::clear()
+
+// Main methods (of the kVTree interface)
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K, typename... Args>
+std::pair<Node*, bool> BaseTree<kT, vT, Node, Compare, Alloc>::emplace_key(Node *hint, K &&key, Args&&... args)
 {
-    this->traverse([](Node *node)
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_near(hint, key);
+    if (search.second == 0)
     {
-        delete node;
-        LOG("[ MEMORY ] Deleted Node.");
-    });
+        return { search.first, false };
+    }
+    return {
+        this->insert_at(search, std::forward<K>(key), std::forward<Args>(args)...),
+        true
+    };
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K, typename M>
+std::pair<Node*, bool> BaseTree<kT, vT, Node, Compare, Alloc>::assign_key(Node *hint, K &&key, M &&obj)
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_near(hint, key);
+    if (search.second == 0)
+    {
+        // key already exists - just replace the value
+        search.first->value = std::forward<M>(obj);
+        if constexpr (aggregate_node<Node>)
+        {
+            // aggregates may depend on the value
+            this->update_path(search.first);
+        }
+        return { search.first, false };
+    }
+    return {
+        this->insert_at(search, std::forward<K>(key), std::forward<M>(obj)),
+        true
+    };
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+vT& BaseTree<kT, vT, Node, Compare, Alloc>::operator[](const kT &key)
+{
+    // value is value-initialized in place if the key is absent
+    return this->touch(this->emplace_key(this->finger, key).first)->value;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+vT& BaseTree<kT, vT, Node, Compare, Alloc>::operator[](kT &&key)
+{
+    return this->touch(this->emplace_key(this->finger, std::move(key)).first)->value;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+bool BaseTree<kT, vT, Node, Compare, Alloc>::insert(const kT &key, const vT &value)
+{
+    return this->assign_key(this->finger, key, value).second;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+bool BaseTree<kT, vT, Node, Compare, Alloc>::insert(kT &&key, vT &&value)
+{
+    return this->assign_key(this->finger, std::move(key), std::move(value)).second;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename... Args>
+std::pair<typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator, bool>
+BaseTree<kT, vT, Node, Compare, Alloc>::try_emplace(const kT &key, Args&&... args)
+{
+    auto result = this->emplace_key(this->finger, key, std::forward<Args>(args)...);
+    return { iterator(result.first, this), result.second };
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename... Args>
+std::pair<typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator, bool>
+BaseTree<kT, vT, Node, Compare, Alloc>::try_emplace(kT &&key, Args&&... args)
+{
+    auto result = this->emplace_key(this->finger, std::move(key), std::forward<Args>(args)...);
+    return { iterator(result.first, this), result.second };
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K, typename... Args>
+std::pair<typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator, bool>
+BaseTree<kT, vT, Node, Compare, Alloc>::emplace(K &&key, Args&&... args)
+{
+    if constexpr (std::is_same_v<std::remove_cvref_t<K>, kT>)
+    {
+        return this->try_emplace(std::forward<K>(key), std::forward<Args>(args)...);
+    }
+    else
+    {
+        return this->try_emplace(kT(std::forward<K>(key)), std::forward<Args>(args)...);
+    }
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename M>
+std::pair<typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator, bool>
+BaseTree<kT, vT, Node, Compare, Alloc>::insert_or_assign(const kT &key, M &&obj)
+{
+    auto result = this->assign_key(this->finger, key, std::forward<M>(obj));
+    return { iterator(result.first, this), result.second };
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename M>
+std::pair<typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator, bool>
+BaseTree<kT, vT, Node, Compare, Alloc>::insert_or_assign(kT &&key, M &&obj)
+{
+    auto result = this->assign_key(this->finger, std::move(key), std::forward<M>(obj));
+    return { iterator(result.first, this), result.second };
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::hint_node(const Node *hint) const
+{
+    // the node before end() is the greatest one
+    return hint != nullptr ? const_cast<Node*>(hint) : this->max_node;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename... Args>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator
+BaseTree<kT, vT, Node, Compare, Alloc>::try_emplace(const_iterator hint, const kT &key, Args&&... args)
+{
+    return iterator(this->emplace_key(this->hint_node(hint.node), key, std::forward<Args>(args)...).first, this);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename... Args>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator
+BaseTree<kT, vT, Node, Compare, Alloc>::try_emplace(const_iterator hint, kT &&key, Args&&... args)
+{
+    return iterator(this->emplace_key(this->hint_node(hint.node), std::move(key), std::forward<Args>(args)...).first, this);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename M>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator
+BaseTree<kT, vT, Node, Compare, Alloc>::insert_or_assign(const_iterator hint, const kT &key, M &&obj)
+{
+    return iterator(this->assign_key(this->hint_node(hint.node), key, std::forward<M>(obj)).first, this);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename M>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator
+BaseTree<kT, vT, Node, Compare, Alloc>::insert_or_assign(const_iterator hint, kT &&key, M &&obj)
+{
+    return iterator(this->assign_key(this->hint_node(hint.node), std::move(key), std::forward<M>(obj)).first, this);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+bool BaseTree<kT, vT, Node, Compare, Alloc>::find(const kT &key, vT& dst) const
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    if (search.second != 0)
+    {
+        return false;
+    }
+    dst = search.first->value;
+    return true;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+const vT *BaseTree<kT, vT, Node, Compare, Alloc>::lookup(const kT &key) const
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    return search.second == 0 ? &search.first->value : nullptr;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+vT *BaseTree<kT, vT, Node, Compare, Alloc>::lookup(const kT &key)
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    return search.second == 0 ? &this->touch(search.first)->value : nullptr;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename F>
+bool BaseTree<kT, vT, Node, Compare, Alloc>::find_and(const kT &key, F &&fn) const
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    if (search.second != 0)
+    {
+        return false;
+    }
+    fn(static_cast<const vT&>(search.first->value));
+    return true;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator BaseTree<kT, vT, Node, Compare, Alloc>::find(const kT &key)
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    return iterator(search.second == 0 ? search.first : nullptr, this);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::const_iterator BaseTree<kT, vT, Node, Compare, Alloc>::find(const kT &key) const
+{
+    return const_cast<BaseTree<kT, vT, Node, Compare, Alloc>*>(this)->find(key);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::size_t BaseTree<kT, vT, Node, Compare, Alloc>::find_batch(std::span<const kT> keys, std::span<const vT*> out) const
+{
+    std::size_t found = 0;
+    for (std::size_t first = 0; first < keys.size(); first += BATCH_GROUP)
+    {
+        std::size_t n = std::min(BATCH_GROUP, keys.size() - first);
+
+        // current node of every search (null when it is over)
+        const Node *current[BATCH_GROUP];
+        for (std::size_t i = 0; i < n; i++)
+        {
+            current[i] = this->root;
+            out[first + i] = nullptr;
+        }
+
+        for (bool active = this->root != nullptr; active; )
+        {
+            active = false;
+            for (std::size_t i = 0; i < n; i++)
+            {
+                const Node *node = current[i];
+                if (node == nullptr)
+                {
+                    continue;
+                }
+
+                auto order = key_order(this->comp, keys[first + i], node->key);
+                if (order == 0)
+                {
+                    out[first + i] = &node->value;
+                    found++;
+                    node = nullptr;
+                }
+                else
+                {
+                    node = order < 0 ? node->left : node->right;
+                    if (node != nullptr)
+                    {
+                        PREFETCH(node);
+                        active = true;
+                    }
+                }
+                current[i] = node;
+            }
+        }
+    }
+    return found;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::size_t BaseTree<kT, vT, Node, Compare, Alloc>::find_sorted_batch(std::span<const kT> keys, std::span<const vT*> out) const
+{
+    std::size_t found = 0;
+
+    // the last node visited by the previous search: the previous key is
+    // within the range of keys of its subtree
+    const Node *finger = this->root;
+    for (std::size_t i = 0; i < keys.size(); i++)
+    {
+        const kT &key = keys[i];
+        const Node *node = finger;
+        if (i > 0 && key_less(this->comp, key, keys[i - 1]))
+        {
+            node = this->root;
+        }
+        else
+        {
+            // the key is not less than the lower bound of the subtree, so go
+            // up until it is less than the upper bound: the key of the
+            // nearest ancestor that has the subtree on its left
+            while (node != nullptr && node->parent != nullptr &&
+                (node->parent->right == node || !key_less(this->comp, key, node->parent->key)))
+            {
+                node = node->parent;
+            }
+        }
+
+        out[i] = nullptr;
+        while (node != nullptr)
+        {
+            finger = node;
+            auto order = key_order(this->comp, key, node->key);
+            if (order == 0)
+            {
+                out[i] = &node->value;
+                found++;
+                break;
+            }
+            node = order < 0 ? node->left : node->right;
+        }
+    }
+    return found;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+lookup_task<const vT*> BaseTree<kT, vT, Node, Compare, Alloc>::lookup_coro(const kT &key) const
+{
+    const Node *node = this->root;
+    while (node != nullptr)
+    {
+        auto order = key_order(this->comp, key, node->key);
+        if (order == 0)
+        {
+            co_return &node->value;
+        }
+        node = order < 0 ? node->left : node->right;
+        if (node != nullptr)
+        {
+            co_await prefetch_and_suspend{ node };
+        }
+    }
+    co_return nullptr;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K> requires lookup_key<Compare, K, kT>
+const vT *BaseTree<kT, vT, Node, Compare, Alloc>::lookup(const K &key) const
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    return search.second == 0 ? &search.first->value : nullptr;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K> requires lookup_key<Compare, K, kT>
+vT *BaseTree<kT, vT, Node, Compare, Alloc>::lookup(const K &key)
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    return search.second == 0 ? &this->touch(search.first)->value : nullptr;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K, typename F> requires lookup_key<Compare, K, kT>
+bool BaseTree<kT, vT, Node, Compare, Alloc>::find_and(const K &key, F &&fn) const
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    if (search.second != 0)
+    {
+        return false;
+    }
+    fn(static_cast<const vT&>(search.first->value));
+    return true;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K> requires lookup_key<Compare, K, kT>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator BaseTree<kT, vT, Node, Compare, Alloc>::find(const K &key)
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    return iterator(search.second == 0 ? search.first : nullptr, this);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename K> requires lookup_key<Compare, K, kT>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::const_iterator BaseTree<kT, vT, Node, Compare, Alloc>::find(const K &key) const
+{
+    return const_cast<BaseTree<kT, vT, Node, Compare, Alloc>*>(this)->find(key);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+bool BaseTree<kT, vT, Node, Compare, Alloc>::contains(const kT &key) const
+{
+    return this->search_by_key(key).second == 0;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+bool BaseTree<kT, vT, Node, Compare, Alloc>::erase(const kT &key)
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    if (search.second == 0)
+    {
+        this->refresh();
+        this->delete_at(search.first);
+        return true;
+    }
+    return false;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::pair<
+    typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator,
+    typename BaseTree<kT, vT, Node, Compare, Alloc>::iterator
+> BaseTree<kT, vT, Node, Compare, Alloc>::equal_range(const kT &key)
+{
+    BaseTree<kT, vT, Node, Compare, Alloc>::search_t search = this->search_by_key(key);
+    if (search.second == 0)
+    {
+        return { iterator(search.first, this), iterator(successor(search.first), this) };
+    }
+    // key is absent - both ends point to the node that would follow it
+    iterator next(this->upper_bound_node(key), this);
+    return { next, next };
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::pair<
+    typename BaseTree<kT, vT, Node, Compare, Alloc>::const_iterator,
+    typename BaseTree<kT, vT, Node, Compare, Alloc>::const_iterator
+> BaseTree<kT, vT, Node, Compare, Alloc>::equal_range(const kT &key) const
+{
+    auto range = const_cast<BaseTree<kT, vT, Node, Compare, Alloc>*>(this)->equal_range(key);
+    return { range.first, range.second };
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::size_t BaseTree<kT, vT, Node, Compare, Alloc>::count_range(const kT &lo, const kT &hi) const requires sized_node<Node>
+{
+    if (key_less(this->comp, hi, lo))
+    {
+        return 0;
+    }
+    return this->count_below(hi, true) - this->count_below(lo, false);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+auto BaseTree<kT, vT, Node, Compare, Alloc>::aggregate(const kT &lo, const kT &hi) const requires aggregate_node<Node>
+{
+    using monoid = typename decltype(Node::augment)::monoid;
+    auto total = [](const Node *node) { return node == nullptr ? monoid::identity() : node->augment.total; };
+    this->refresh();
+
+    // the highest node in the range: the paths to both ends split there
+    const Node *split = key_less(this->comp, hi, lo) ? nullptr : this->root;
+    while (split != nullptr)
+    {
+        if (key_less(this->comp, split->key, lo))
+        {
+            split = split->right;
+        }
+        else if (key_less(this->comp, hi, split->key))
+        {
+            split = split->left;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (split == nullptr)
+    {
+        return monoid::identity();
+    }
+
+    // on the way to lo, every node in the range comes with its right subtree,
+    // and they go before the ones found above; on the way to hi - the other
+    // way round
+    auto left = monoid::identity();
+    for (const Node *node = split->left; node != nullptr; )
+    {
+        if (key_less(this->comp, node->key, lo))
+        {
+            node = node->right;
+        }
+        else
+        {
+            left = monoid::combine(monoid::combine(monoid::of(node->key, node->value), total(node->right)), left);
+            node = node->left;
+        }
+    }
+    auto right = monoid::identity();
+    for (const Node *node = split->right; node != nullptr; )
+    {
+        if (key_less(this->comp, hi, node->key))
+        {
+            node = node->left;
+        }
+        else
+        {
+            right = monoid::combine(right, monoid::combine(total(node->left), monoid::of(node->key, node->value)));
+            node = node->right;
+        }
+    }
+    return monoid::combine(monoid::combine(left, monoid::of(split->key, split->value)), right);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename P, typename F> requires interval_node<Node>
+void BaseTree<kT, vT, Node, Compare, Alloc>::for_each_overlapping(const P &lo, const P &hi, F &&fn) const
+{
+    // in-order walk (without recursion) that skips the subtrees ending
+    // before lo and stops at the first interval starting after hi: all the
+    // following ones start after it too
+    const Node *node = this->root;
+    if (node == nullptr || node->augment.max_end < lo)
+    {
+        return;
+    }
+    while (true)
+    {
+        // node is the root of a subtree that has to be visited
+        while (node->left != nullptr && !(node->left->augment.max_end < lo))
+        {
+            node = node->left;
+        }
+
+        // visit the nodes in order until there is a right subtree to visit
+        while (true)
+        {
+            if (hi < node->key.lo)
+            {
+                return;
+            }
+            if (node->key.overlaps(lo, hi))
+            {
+                fn(node->key, node->value);
+            }
+            if (node->right != nullptr && !(node->right->augment.max_end < lo))
+            {
+                node = node->right;
+                break;
+            }
+
+            // back to the nearest ancestor whose left subtree is done
+            while (node->parent != nullptr && node->parent->right == node)
+            {
+                node = node->parent;
+            }
+            node = node->parent;
+            if (node == nullptr)
+            {
+                return;
+            }
+        }
+    }
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::pair<Node*, Node*> BaseTree<kT, vT, Node, Compare, Alloc>::detach_children(Node *node)
+{
+    std::pair<Node*, Node*> children(node->left, node->right);
+    for (Node *child : { node->left, node->right })
+    {
+        if (child != nullptr)
+        {
+            child->parent = nullptr;
+        }
+    }
+    node->left = nullptr;
+    node->right = nullptr;
+    return children;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+typename BaseTree<kT, vT, Node, Compare, Alloc>::split_t BaseTree<kT, vT, Node, Compare, Alloc>::split_node(Node *node, const kT &key) const requires joinable_node<Node>
+{
+    if (node == nullptr)
+    {
+        return { nullptr, nullptr, nullptr };
+    }
+
+    // the subtree on the other side of the key is joined back with the node
+    auto [less, greater] = detach_children(node);
+    auto order = key_order(this->comp, key, node->key);
+    if (order == 0)
+    {
+        return { less, node, greater };
+    }
+    if (order < 0)
+    {
+        split_t result = this->split_node(less, key);
+        result.greater = Node::join(result.greater, node, greater);
+        return result;
+    }
+    split_t result = this->split_node(greater, key);
+    result.less = Node::join(less, node, result.less);
+    return result;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::join_nodes(Node *less, Node *greater) requires joinable_node<Node>
+{
+    if (less == nullptr)
+    {
+        return greater;
+    }
+    if (greater == nullptr)
+    {
+        return less;
+    }
+    Node *last;
+    less = take_last(less, last);
+    return Node::join(less, last, greater);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::take_last(Node *node, Node *&last) requires joinable_node<Node>
+{
+    auto [less, greater] = detach_children(node);
+    if (greater == nullptr)
+    {
+        last = node;
+        return less;
+    }
+    Node *rest = take_last(greater, last);
+    return Node::join(less, node, rest);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::recurse(set_operation_t operation, Node *a_less, Node *b_less, Node *&less,
+    Node *a_greater, Node *b_greater, Node *&greater, std::vector<Node*> &discarded,
+    unsigned forks) const
+{
+    // the work is about the size of the smaller tree of a pair
+    auto large = [](const Node *a, const Node *b)
+    {
+        if constexpr (requires { a->height; })
+        {
+            return a != nullptr && b != nullptr &&
+                a->height >= PARALLEL_MIN_HEIGHT && b->height >= PARALLEL_MIN_HEIGHT;
+        }
+        else
+        {
+            return false;
+        }
+    };
+    bool fork = forks > 0 && large(a_less, b_less) && large(a_greater, b_greater);
+    if (fork)
+    {
+        forks--;
+    }
+
+    std::vector<Node*> forked_discarded;
+    fork_join(fork,
+        [&]() { less = (this->*operation)(a_less, b_less, fork ? forked_discarded : discarded, forks); },
+        [&]() { greater = (this->*operation)(a_greater, b_greater, discarded, forks); });
+    discarded.insert(discarded.end(), forked_discarded.begin(), forked_discarded.end());
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::union_nodes(Node *a, Node *b, std::vector<Node*> &discarded, unsigned forks) const
+    requires joinable_node<Node>
+{
+    if (a == nullptr)
+    {
+        return b;
+    }
+    if (b == nullptr)
+    {
+        return a;
+    }
+
+    // the root of a splits b, the halves are united separately
+    auto [a_less, a_greater] = detach_children(a);
+    split_t split = this->split_node(b, a->key);
+    if (split.equal != nullptr)
+    {
+        discarded.push_back(split.equal);
+    }
+    Node *less, *greater;
+    this->recurse(&BaseTree<kT, vT, Node, Compare, Alloc>::union_nodes, a_less, split.less, less,
+        a_greater, split.greater, greater, discarded, forks);
+    return Node::join(less, a, greater);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::intersection_nodes(Node *a, Node *b, std::vector<Node*> &discarded, unsigned forks) const
+    requires joinable_node<Node>
+{
+    if (a == nullptr || b == nullptr)
+    {
+        for (Node *node : { a, b })
+        {
+            if (node != nullptr)
+            {
+                discarded.push_back(node);
+            }
+        }
+        return nullptr;
+    }
+
+    auto [a_less, a_greater] = detach_children(a);
+    split_t split = this->split_node(b, a->key);
+    Node *less, *greater;
+    this->recurse(&BaseTree<kT, vT, Node, Compare, Alloc>::intersection_nodes, a_less, split.less, less,
+        a_greater, split.greater, greater, discarded, forks);
+    if (split.equal != nullptr)
+    {
+        discarded.push_back(split.equal);
+        return Node::join(less, a, greater);
+    }
+    discarded.push_back(a);
+    return join_nodes(less, greater);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+Node *BaseTree<kT, vT, Node, Compare, Alloc>::difference_nodes(Node *a, Node *b, std::vector<Node*> &discarded, unsigned forks) const
+    requires joinable_node<Node>
+{
+    if (a == nullptr || b == nullptr)
+    {
+        if (b != nullptr)
+        {
+            discarded.push_back(b);
+        }
+        return a;
+    }
+
+    // the root of b splits a (and is dropped along with its match)
+    auto [b_less, b_greater] = detach_children(b);
+    split_t split = this->split_node(a, b->key);
+    discarded.push_back(b);
+    if (split.equal != nullptr)
+    {
+        discarded.push_back(split.equal);
+    }
+    Node *less, *greater;
+    this->recurse(&BaseTree<kT, vT, Node, Compare, Alloc>::difference_nodes, split.less, b_less, less,
+        split.greater, b_greater, greater, discarded, forks);
+    return join_nodes(less, greater);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::set_operation(BaseTree<kT, vT, Node, Compare, Alloc> &&other, set_operation_t operation)
+{
+    this->refresh();
+    other.refresh();
+    this->alloc.share(other.alloc);
+    std::size_t total = this->_size + other._size;
+    Node *a = std::exchange(this->root, nullptr);
+    Node *b = std::exchange(other.root, nullptr);
+    other.clear();
+
+    std::vector<Node*> discarded;
+    this->root = (this->*operation)(a, b, discarded, fork_depth());
+    for (Node *node : discarded)
+    {
+        total -= this->destroy_subtree(node, true);
+    }
+    this->_size = total;
+    this->finger = nullptr;
+    this->max_node = rightmost(this->root);
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (this->root != nullptr && !this->root->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::join(BaseTree<kT, vT, Node, Compare, Alloc> &&greater)
+    requires joinable_node<Node> && shared_allocator<Alloc>
+{
+    if (this == &greater || greater.root == nullptr)
+    {
+        return;
+    }
+    this->refresh();
+    greater.refresh();
+    this->alloc.share(greater.alloc);
+    Node *greater_root = std::exchange(greater.root, nullptr);
+    this->_size += greater._size;
+    this->max_node = greater.max_node;
+    greater.clear();
+
+    this->root = join_nodes(this->root, greater_root);
+    this->finger = nullptr;
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (this->root != nullptr && !this->root->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+BaseTree<kT, vT, Node, Compare, Alloc> BaseTree<kT, vT, Node, Compare, Alloc>::split(const kT &key)
+    requires joinable_node<Node> && shared_allocator<Alloc>
+{
+    BaseTree<kT, vT, Node, Compare, Alloc> result(this->comp);
+
+    this->refresh();
+    split_t split = this->split_node(std::exchange(this->root, nullptr), key);
+    this->root = split.less;
+    result.root = split.equal == nullptr ? split.greater :
+        Node::join(nullptr, split.equal, split.greater);
+
+    std::size_t total = this->_size;
+    auto [smaller, is_less] = count_smaller(this->root, result.root);
+    this->_size = is_less ? smaller : total - smaller;
+    result._size = total - this->_size;
+    result.max_node = rightmost(result.root);
+    this->max_node = rightmost(this->root);
+    this->finger = nullptr;
+
+    // the slabs are shared only if both trees keep some Nodes
+    if (this->root == nullptr)
+    {
+        std::swap(this->alloc, result.alloc);
+    }
+    else if (result.root != nullptr)
+    {
+        result.alloc.share(this->alloc);
+    }
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (this->root != nullptr && !this->root->is_valid() ||
+        result.root != nullptr && !result.root->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+    return result;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::set_union(BaseTree<kT, vT, Node, Compare, Alloc> &&other)
+    requires joinable_node<Node> && shared_allocator<Alloc>
+{
+    if (this != &other)
+    {
+        this->set_operation(std::move(other), &BaseTree<kT, vT, Node, Compare, Alloc>::union_nodes);
+    }
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::set_intersection(BaseTree<kT, vT, Node, Compare, Alloc> &&other)
+    requires joinable_node<Node> && shared_allocator<Alloc>
+{
+    if (this != &other)
+    {
+        this->set_operation(std::move(other), &BaseTree<kT, vT, Node, Compare, Alloc>::intersection_nodes);
+    }
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::set_difference(BaseTree<kT, vT, Node, Compare, Alloc> &&other)
+    requires joinable_node<Node> && shared_allocator<Alloc>
+{
+    if (this == &other)
+    {
+        this->clear();
+        return;
+    }
+    this->set_operation(std::move(other), &BaseTree<kT, vT, Node, Compare, Alloc>::difference_nodes);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+template <typename InputIt>
+void BaseTree<kT, vT, Node, Compare, Alloc>::assign(InputIt first, InputIt last)
+{
+    using category = typename std::iterator_traits<InputIt>::iterator_category;
+    if constexpr (std::is_base_of_v<std::random_access_iterator_tag, category>)
+    {
+        // already sorted input can be used as is
+        auto unordered = std::adjacent_find(first, last, [this](const auto &a, const auto &b)
+        {
+            return !key_less(this->comp, a.first, b.first);
+        });
+        if (unordered == last)
+        {
+            this->clear();
+            this->build(first, last);
+            return;
+        }
+    }
+    this->assign(std::vector<std::pair<kT, vT>>(first, last));
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::assign(std::vector<std::pair<kT, vT>> &&items)
+{
+    this->assign_items(std::move(items), 0);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::parallel_assign(std::vector<std::pair<kT, vT>> &&items)
+    requires shared_allocator<Alloc>
+{
+    this->assign_items(std::move(items), fork_depth());
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::assign_items(std::vector<std::pair<kT, vT>> &&items, unsigned forks)
+{
+    auto item_less = [this](const std::pair<kT, vT> &a, const std::pair<kT, vT> &b)
+    {
+        return key_less(this->comp, a.first, b.first);
+    };
+
+    if (!std::is_sorted(items.begin(), items.end(), item_less))
+    {
+        // stable, so that the last of the equal keys is still the last one
+        parallel_stable_sort(items.begin(), items.end(), item_less, forks);
+    }
+
+    // remove duplicates, keeping the last item for every key
+    auto out = items.begin();
+    for (auto it = items.begin(); it != items.end(); ++it)
+    {
+        if (out != items.begin() && !item_less(*(out - 1), *it))
+        {
+            *(out - 1) = std::move(*it);
+            continue;
+        }
+        if (out != it)
+        {
+            *out = std::move(*it);
+        }
+        ++out;
+    }
+    items.erase(out, items.end());
+
+    this->clear();
+    this->build(std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()), forks);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::size_t BaseTree<kT, vT, Node, Compare, Alloc>::depth() const
+{
+    if constexpr (requires { this->root->height; })
+    {
+        return this->root == nullptr ? 0 : this->root->height;
+    }
+    else
+    {
+        return this->shape().height;
+    }
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+tree_shape BaseTree<kT, vT, Node, Compare, Alloc>::shape() const
+{
+    tree_shape result{};
+
+    // depth-first walk using parent pointers: where we came from tells
+    // which child (if any) is to be visited next
+    const Node *current = this->root, *previous = nullptr;
+    std::size_t depth = 1;
+    while (current != nullptr)
+    {
+        const Node *next;
+        if (previous == current->parent)
+        {
+            // first visit
+            if (result.histogram.size() < depth)
+            {
+                result.histogram.push_back(0);
+            }
+            result.histogram[depth - 1]++;
+            result.total_path_length += depth;
+            result.size++;
+
+            next = current->left != nullptr ? current->left :
+                (current->right != nullptr ? current->right : current->parent);
+        }
+        else if (previous == current->left && current->right != nullptr)
+        {
+            next = current->right;
+        }
+        else
+        {
+            next = current->parent;
+        }
+
+        depth = next == current->parent ? depth - 1 : depth + 1;
+        previous = current;
+        current = next;
+    }
+
+    result.height = result.histogram.size();
+    return result;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::clear()
+{
+    // if the allocator can free everything at once, nodes only have to be
+    // visited to call their destructors
+    if constexpr (!Alloc::bulk_release || !std::is_trivially_destructible_v<Node>)
+    {
+        this->destroy_all();
+    }
+    this->alloc.release();
     this->root = nullptr;
     this->_size = 0;
+    this->finger = nullptr;
+    this->max_node = nullptr;
+    this->stale = {};
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::destroy_all()
+{
+    this->destroy_subtree(this->root, !Alloc::bulk_release);
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::size_t BaseTree<kT, vT, Node, Compare, Alloc>::destroy_subtree(Node *node, bool recycle)
+{
+    // post-order walk that unlinks each node from its parent before
+    // destroying it, so parent pointers are enough to find the way back
+    std::size_t count = 0;
+    Node *current = node;
+    while (current != nullptr)
+    {
+        if (current->left != nullptr)
+        {
+            current = current->left;
+            continue;
+        }
+        if (current->right != nullptr)
+        {
+            current = current->right;
+            continue;
+        }
+
+        Node *parent = current->parent;
+        if (parent != nullptr)
+        {
+            (parent->left == current ? parent->left : parent->right) = nullptr;
+        }
+
+        if (recycle)
+        {
+            this->alloc.destroy(current);
+        }
+        else
+        {
+            current->~Node();
+        }
+        count++;
+        current = parent;
+    }
+    return count;
+}
+
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+std::pair<std::size_t, bool> BaseTree<kT, vT, Node, Compare, Alloc>::count_smaller(const Node *a, const Node *b)
+{
+    if constexpr (sized_node<Node>)
+    {
+        std::size_t a_size = count_nodes(a);
+        std::size_t b_size = count_nodes(b);
+        return { a_size <= b_size ? a_size : b_size, a_size <= b_size };
+    }
+    else
+    {
+        // the trees are detached, so successor() ends at their last nodes
+        std::size_t count = 0;
+        a = leftmost(a);
+        b = leftmost(b);
+        while (a != nullptr && b != nullptr)
+        {
+            a = successor(a);
+            b = successor(b);
+            count++;
+        }
+        return { count, a == nullptr };
+    }
 }
 
-template <typename kT, typename vT, class Node>
-void BaseTree<kT, vT, Node>::traverse(std::function<void(Node*)> func)
+template <typename kT, typename vT, class Node, class Compare, class Alloc>
+void BaseTree<kT, vT, Node, Compare, Alloc>::traverse(std::function<void(Node*)> func)
 {
     if (this->root == nullptr)
     {
@@ -0,0 +1,1101 @@
+#pragma once
+
+#include "common.h"
+#include "frozen_tree.h"
+#include "key_compare.h"
+#include "node_pool.h"
+#include "simd_search.h"
+#include "target_interface.h"
+
+#include <algorithm>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+// B+-tree (implements the key_value_tree interface, see "target_interface.h").
+//
+// Unlike the binary trees (see "base.h"), every node holds many keys stored
+// contiguously, so a lookup touches a few cache lines per level and there
+// are only log_B(n) levels. Key-value pairs live in the leaves only; inner
+// nodes hold separator keys (copies of the smallest key of the subtree to
+// the right of the separator). Leaves are linked into a list, so a scan over
+// the tree (see begin / end and lower_bound) reads the leaves sequentially.
+//
+// NodeSize is the approximate size of a node in bytes (the number of keys in
+// a node is derived from it); the default is 4 cache lines of 64 bytes.
+//
+// Compare is the comparator for the keys (see "key_compare.h"). For integer
+// keys ordered by a standard comparator, the search inside the nodes uses
+// vectorized kernels (see "simd_search.h"), otherwise it is a binary search.
+//
+// Entries move between and inside the nodes on modifications, so:
+//  - pointers returned by lookup and iterators are invalidated by any
+//    insertion or erasure;
+//  - kT and vT must be default constructible and move assignable, kT must
+//    also be copy constructible (separators are copies of the keys).
+template <
+    typename kT, typename vT,
+    class Compare = default_compare,
+    std::size_t NodeSize = 256
+>
+class BTree
+{
+private:
+
+    struct Node
+    {
+        // number of keys
+        std::uint32_t count;
+        bool leaf;
+    };
+
+    static constexpr std::size_t HEADER_SIZE = sizeof(Node) + sizeof(void*);
+
+    static constexpr std::size_t fit(std::size_t entry_size)
+    {
+        return NodeSize > HEADER_SIZE + 4 * entry_size ?
+            (NodeSize - HEADER_SIZE) / entry_size : 4;
+    }
+
+public:
+
+    // maximum number of entries in a leaf and of keys in an inner node
+    static constexpr std::size_t LEAF_SIZE = fit(sizeof(kT) + sizeof(vT));
+    static constexpr std::size_t INNER_SIZE = fit(sizeof(kT) + sizeof(void*));
+
+private:
+
+    // nodes (except the root) never have less keys than this
+    static constexpr std::size_t LEAF_MIN = LEAF_SIZE / 2;
+    static constexpr std::size_t INNER_MIN = (INNER_SIZE - 1) / 2;
+
+    // enough for any tree that fits into memory (inner nodes have at least
+    // 2 children)
+    static constexpr std::size_t MAX_HEIGHT = 64;
+
+    struct Leaf : Node
+    {
+        kT keys[LEAF_SIZE];
+        vT values[LEAF_SIZE];
+
+        Leaf *next;
+
+        Leaf(): Node{0, true}, keys(), values(), next(nullptr) {}
+    };
+
+    struct Inner : Node
+    {
+        // children[i] holds the keys less than keys[i], children[i + 1] -
+        // greater or equal
+        kT keys[INNER_SIZE];
+        Node *children[INNER_SIZE + 1];
+
+        Inner(): Node{0, false}, keys(), children() {}
+    };
+
+    // inner node on the way from the root and the index of the child taken
+    struct path_entry
+    {
+        Inner *node;
+        std::size_t slot;
+    };
+
+    [[no_unique_address]] Compare comp;
+
+    NodePool<Leaf> leaves;
+    NodePool<Inner> inners;
+
+    Node *root;
+
+    // head of the list of leaves
+    Leaf *first;
+
+    std::size_t _size;
+    std::size_t _height;
+
+    // Index of the first of n keys that is not less than key.
+    template <typename K>
+    std::size_t lower_index(const kT *keys, std::size_t n, const K &key) const;
+
+    // Index of the first of n keys that is greater than key.
+    template <typename K>
+    std::size_t upper_index(const kT *keys, std::size_t n, const K &key) const;
+
+    // Descend to the leaf that should hold the key, remembering the path in
+    // path (if not null). Returns the leaf (null if the tree is empty) and
+    // the position of the first key in it that is not less than key.
+    template <typename K>
+    std::pair<Leaf*, std::size_t> descend(const K &key, path_entry *path) const;
+
+    // Same as descend, but the leaf is null if the key is not found.
+    template <typename K>
+    std::pair<Leaf*, std::size_t> search_by_key(const K &key) const;
+
+    // Insert an entry with the key constructed from key and the value
+    // constructed from args if the key is absent.
+    // Returns the leaf and the position of the entry with the key and true if
+    // it has been inserted.
+    template <typename K, typename... Args>
+    std::pair<std::pair<Leaf*, std::size_t>, bool> emplace_key(K &&key, Args&&... args);
+
+    // Move the upper half of the full leaf into a new one (linked after it).
+    Leaf *split_leaf(Leaf *leaf);
+
+    // Link right (just split from left) into the parent of left, which is
+    // path[depth - 1], splitting the inner nodes up the path if needed.
+    void insert_into_parent(path_entry *path, std::size_t depth, Node *left, kT separator, Node *right);
+
+    // Restore the minimal number of keys in the child parent->children[slot]
+    // by borrowing from or merging with a sibling.
+    void fix_underflow(Inner *parent, std::size_t slot);
+
+    // Merge parent->children[slot + 1] into parent->children[slot].
+    void merge_children(Inner *parent, std::size_t slot);
+
+    Node *copy_node(const Node *other, Leaf *&last);
+
+    void destroy_all(Node *node);
+
+    void shape_node(const Node *node, std::size_t depth, tree_shape &result) const;
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+    // Check the subtree and its keys against the bounds (if not null), and
+    // count its entries.
+    bool validate(const Node *node, std::size_t depth, const kT *low, const kT *high,
+        std::size_t &n_entries) const;
+
+    bool is_valid() const;
+
+#endif
+
+public:
+
+    using key_type = kT;
+    using mapped_type = vT;
+
+    // Forward iterator over the entries in the order of the keys.
+    template <bool Const>
+    class tree_iterator
+    {
+    private:
+
+        friend class BTree<kT, vT, Compare, NodeSize>;
+        friend class tree_iterator<!Const>;
+
+        Leaf *leaf;
+        std::size_t index;
+
+        tree_iterator(Leaf *_leaf, std::size_t _index):
+            leaf(_leaf),
+            index(_index)
+        {
+            // the position past the end of a leaf is the start of the next one
+            if (this->leaf != nullptr && this->index == this->leaf->count)
+            {
+                this->leaf = this->leaf->next;
+                this->index = 0;
+            }
+        }
+
+    public:
+
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::pair<const kT, vT>;
+        using reference = std::pair<const kT&, std::conditional_t<Const, const vT&, vT&>>;
+
+        struct pointer
+        {
+            reference ref;
+            const reference *operator->() const { return &this->ref; }
+        };
+
+        tree_iterator(): leaf(nullptr), index(0) {}
+
+        template <bool OtherConst>
+        tree_iterator(const tree_iterator<OtherConst> &other) requires (Const && !OtherConst):
+            leaf(other.leaf),
+            index(other.index)
+        {}
+
+        reference operator*() const
+        {
+            return reference(this->leaf->keys[this->index], this->leaf->values[this->index]);
+        }
+
+        pointer operator->() const { return pointer{ **this }; }
+
+        tree_iterator &operator++()
+        {
+            if (++this->index == this->leaf->count)
+            {
+                this->leaf = this->leaf->next;
+                this->index = 0;
+            }
+            return *this;
+        }
+
+        tree_iterator operator++(int)
+        {
+            tree_iterator copy = *this;
+            ++(*this);
+            return copy;
+        }
+
+        friend bool operator==(const tree_iterator &a, const tree_iterator &b)
+        {
+            return a.leaf == b.leaf && a.index == b.index;
+        }
+    };
+
+    using iterator = tree_iterator<false>;
+    using const_iterator = tree_iterator<true>;
+
+    BTree();
+
+    explicit BTree(const Compare &_comp);
+
+    BTree(const BTree<kT, vT, Compare, NodeSize> &other);
+    BTree<kT, vT, Compare, NodeSize> &operator=(const BTree<kT, vT, Compare, NodeSize> &other);
+
+    BTree(BTree<kT, vT, Compare, NodeSize> &&other);
+    BTree<kT, vT, Compare, NodeSize> &operator=(BTree<kT, vT, Compare, NodeSize> &&other);
+
+    ~BTree();
+
+    vT& operator[](const kT &key);
+    vT& operator[](kT &&key);
+
+    bool insert(const kT &key, const vT &value);
+    bool insert(kT &&key, vT &&value);
+
+    bool find(const kT &key, vT &dst) const;
+
+    // Pointer to the value is valid until the next modification of the tree.
+    const vT *lookup(const kT &key) const;
+    vT *lookup(const kT &key);
+
+    template <typename F>
+    bool find_and(const kT &key, F &&fn) const;
+
+    iterator find(const kT &key);
+    const_iterator find(const kT &key) const;
+
+    bool contains(const kT &key) const;
+
+    std::size_t size() const;
+
+    bool erase(const kT &key);
+
+    void clear();
+
+    // The number of levels of the tree (all leaves are at the same depth).
+    std::size_t depth() const;
+
+    // Statistics over the nodes of the tree (each holding many keys).
+    tree_shape shape() const;
+
+    // Immutable copy of the tree laid out for fast lookups (see
+    // "frozen_tree.h").
+    FrozenTree<kT, vT, Compare> freeze() const;
+
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+
+    // Iterator to the first entry with the key not less than key.
+    iterator lower_bound(const kT &key);
+    const_iterator lower_bound(const kT &key) const;
+};
+
+static_assert(key_value_tree<BTree<int, int>>);
+
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+template <typename K>
+std::size_t BTree<kT, vT, Compare, NodeSize>::lower_index(const kT *keys, std::size_t n, const K &key) const
+{
+    if constexpr (simd_searchable<kT, Compare> && std::is_same_v<K, kT>)
+    {
+        return simd_lower_index(keys, n, key);
+    }
+
+    std::size_t low = 0;
+    while (n > 0)
+    {
+        std::size_t half = n / 2;
+        if (key_less(this->comp, keys[low + half], key))
+        {
+            low += half + 1;
+            n -= half + 1;
+        }
+        else
+        {
+            n = half;
+        }
+    }
+    return low;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+template <typename K>
+std::size_t BTree<kT, vT, Compare, NodeSize>::upper_index(const kT *keys, std::size_t n, const K &key) const
+{
+    if constexpr (simd_searchable<kT, Compare> && std::is_same_v<K, kT>)
+    {
+        return simd_upper_index(keys, n, key);
+    }
+
+    std::size_t low = 0;
+    while (n > 0)
+    {
+        std::size_t half = n / 2;
+        if (!key_less(this->comp, key, keys[low + half]))
+        {
+            low += half + 1;
+            n -= half + 1;
+        }
+        else
+        {
+            n = half;
+        }
+    }
+    return low;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+template <typename K>
+std::pair<typename BTree<kT, vT, Compare, NodeSize>::Leaf*, std::size_t>
+BTree<kT, vT, Compare, NodeSize>::descend(const K &key, path_entry *path) const
+{
+    const Node *node = this->root;
+    if (node == nullptr)
+    {
+        return { nullptr, 0 };
+    }
+
+    for (std::size_t depth = 0; !node->leaf; depth++)
+    {
+        const Inner *inner = static_cast<const Inner*>(node);
+        std::size_t slot = this->upper_index(inner->keys, inner->count, key);
+        if (path != nullptr)
+        {
+            path[depth] = { const_cast<Inner*>(inner), slot };
+        }
+        node = inner->children[slot];
+    }
+
+    const Leaf *leaf = static_cast<const Leaf*>(node);
+    return { const_cast<Leaf*>(leaf), this->lower_index(leaf->keys, leaf->count, key) };
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+template <typename K>
+std::pair<typename BTree<kT, vT, Compare, NodeSize>::Leaf*, std::size_t>
+BTree<kT, vT, Compare, NodeSize>::search_by_key(const K &key) const
+{
+    auto position = this->descend(key, nullptr);
+    Leaf *leaf = position.first;
+    if (leaf == nullptr || position.second == leaf->count ||
+        key_less(this->comp, key, leaf->keys[position.second]))
+    {
+        return { nullptr, 0 };
+    }
+    return position;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+template <typename K, typename... Args>
+std::pair<std::pair<typename BTree<kT, vT, Compare, NodeSize>::Leaf*, std::size_t>, bool>
+BTree<kT, vT, Compare, NodeSize>::emplace_key(K &&key, Args&&... args)
+{
+    if (this->root == nullptr)
+    {
+        this->first = this->leaves.create();
+        this->root = this->first;
+        this->_height = 1;
+    }
+
+    path_entry path[MAX_HEIGHT];
+    auto [leaf, pos] = this->descend(key, path);
+    if (pos < leaf->count && !key_less(this->comp, key, leaf->keys[pos]))
+    {
+        return { { leaf, pos }, false };
+    }
+
+    if (leaf->count == LEAF_SIZE)
+    {
+        Leaf *right = this->split_leaf(leaf);
+        this->insert_into_parent(path, this->_height - 1, leaf, right->keys[0], right);
+        if (pos > leaf->count)
+        {
+            pos -= leaf->count;
+            leaf = right;
+        }
+    }
+
+    std::move_backward(leaf->keys + pos, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+    std::move_backward(leaf->values + pos, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+    leaf->keys[pos] = kT(std::forward<K>(key));
+    leaf->values[pos] = vT(std::forward<Args>(args)...);
+    leaf->count++;
+    this->_size++;
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (!this->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+    return { { leaf, pos }, true };
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::Leaf *BTree<kT, vT, Compare, NodeSize>::split_leaf(Leaf *leaf)
+{
+    Leaf *right = this->leaves.create();
+    std::size_t mid = LEAF_SIZE / 2;
+
+    std::move(leaf->keys + mid, leaf->keys + LEAF_SIZE, right->keys);
+    std::move(leaf->values + mid, leaf->values + LEAF_SIZE, right->values);
+    right->count = LEAF_SIZE - mid;
+    leaf->count = mid;
+
+    right->next = leaf->next;
+    leaf->next = right;
+    return right;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+void BTree<kT, vT, Compare, NodeSize>::insert_into_parent(path_entry *path, std::size_t depth,
+    Node *left, kT separator, Node *right)
+{
+    while (depth > 0)
+    {
+        depth--;
+        Inner *parent = path[depth].node;
+        std::size_t slot = path[depth].slot;
+
+        if (parent->count == INNER_SIZE)
+        {
+            // split the parent: keys[mid] goes up, keys after it go to the
+            // new node along with the children to the right of it
+            Inner *sibling = this->inners.create();
+            std::size_t mid = INNER_SIZE / 2;
+            kT promoted = std::move(parent->keys[mid]);
+
+            std::move(parent->keys + mid + 1, parent->keys + INNER_SIZE, sibling->keys);
+            std::copy(parent->children + mid + 1, parent->children + INNER_SIZE + 1, sibling->children);
+            sibling->count = INNER_SIZE - mid - 1;
+            parent->count = mid;
+
+            if (slot > mid)
+            {
+                slot -= mid + 1;
+                parent = sibling;
+            }
+            parent->count++;
+            std::move_backward(parent->keys + slot, parent->keys + parent->count - 1, parent->keys + parent->count);
+            std::copy_backward(parent->children + slot + 1, parent->children + parent->count, parent->children + parent->count + 1);
+            parent->keys[slot] = std::move(separator);
+            parent->children[slot + 1] = right;
+
+            left = path[depth].node;
+            separator = std::move(promoted);
+            right = sibling;
+            continue;
+        }
+
+        parent->count++;
+        std::move_backward(parent->keys + slot, parent->keys + parent->count - 1, parent->keys + parent->count);
+        std::copy_backward(parent->children + slot + 1, parent->children + parent->count, parent->children + parent->count + 1);
+        parent->keys[slot] = std::move(separator);
+        parent->children[slot + 1] = right;
+        return;
+    }
+
+    // the root has been split
+    Inner *new_root = this->inners.create();
+    new_root->keys[0] = std::move(separator);
+    new_root->children[0] = left;
+    new_root->children[1] = right;
+    new_root->count = 1;
+    this->root = new_root;
+    this->_height++;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+void BTree<kT, vT, Compare, NodeSize>::fix_underflow(Inner *parent, std::size_t slot)
+{
+    Node *node = parent->children[slot];
+    Node *left = slot > 0 ? parent->children[slot - 1] : nullptr;
+    Node *right = slot < parent->count ? parent->children[slot + 1] : nullptr;
+    std::size_t min = node->leaf ? LEAF_MIN : INNER_MIN;
+
+    if (left != nullptr && left->count > min)
+    {
+        // take the last entry of the left sibling
+        if (node->leaf)
+        {
+            Leaf *l = static_cast<Leaf*>(left), *n = static_cast<Leaf*>(node);
+            std::move_backward(n->keys, n->keys + n->count, n->keys + n->count + 1);
+            std::move_backward(n->values, n->values + n->count, n->values + n->count + 1);
+            n->keys[0] = std::move(l->keys[l->count - 1]);
+            n->values[0] = std::move(l->values[l->count - 1]);
+            parent->keys[slot - 1] = n->keys[0];
+        }
+        else
+        {
+            Inner *l = static_cast<Inner*>(left), *n = static_cast<Inner*>(node);
+            std::move_backward(n->keys, n->keys + n->count, n->keys + n->count + 1);
+            std::copy_backward(n->children, n->children + n->count + 1, n->children + n->count + 2);
+            n->keys[0] = std::move(parent->keys[slot - 1]);
+            n->children[0] = l->children[l->count];
+            parent->keys[slot - 1] = std::move(l->keys[l->count - 1]);
+        }
+        left->count--;
+        node->count++;
+        return;
+    }
+
+    if (right != nullptr && right->count > min)
+    {
+        // take the first entry of the right sibling
+        if (node->leaf)
+        {
+            Leaf *r = static_cast<Leaf*>(right), *n = static_cast<Leaf*>(node);
+            n->keys[n->count] = std::move(r->keys[0]);
+            n->values[n->count] = std::move(r->values[0]);
+            std::move(r->keys + 1, r->keys + r->count, r->keys);
+            std::move(r->values + 1, r->values + r->count, r->values);
+            parent->keys[slot] = r->keys[0];
+        }
+        else
+        {
+            Inner *r = static_cast<Inner*>(right), *n = static_cast<Inner*>(node);
+            n->keys[n->count] = std::move(parent->keys[slot]);
+            n->children[n->count + 1] = r->children[0];
+            parent->keys[slot] = std::move(r->keys[0]);
+            std::move(r->keys + 1, r->keys + r->count, r->keys);
+            std::copy(r->children + 1, r->children + r->count + 1, r->children);
+        }
+        right->count--;
+        node->count++;
+        return;
+    }
+
+    // both siblings (at least one exists) have the minimal number of keys,
+    // so the node fits together with either of them
+    this->merge_children(parent, left != nullptr ? slot - 1 : slot);
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+void BTree<kT, vT, Compare, NodeSize>::merge_children(Inner *parent, std::size_t slot)
+{
+    Node *left = parent->children[slot];
+    Node *right = parent->children[slot + 1];
+
+    if (left->leaf)
+    {
+        Leaf *l = static_cast<Leaf*>(left), *r = static_cast<Leaf*>(right);
+        std::move(r->keys, r->keys + r->count, l->keys + l->count);
+        std::move(r->values, r->values + r->count, l->values + l->count);
+        l->count += r->count;
+        l->next = r->next;
+        this->leaves.destroy(r);
+    }
+    else
+    {
+        // the separator goes down between the keys of the two nodes
+        Inner *l = static_cast<Inner*>(left), *r = static_cast<Inner*>(right);
+        l->keys[l->count] = std::move(parent->keys[slot]);
+        std::move(r->keys, r->keys + r->count, l->keys + l->count + 1);
+        std::copy(r->children, r->children + r->count + 1, l->children + l->count + 1);
+        l->count += r->count + 1;
+        this->inners.destroy(r);
+    }
+
+    std::move(parent->keys + slot + 1, parent->keys + parent->count, parent->keys + slot);
+    std::copy(parent->children + slot + 2, parent->children + parent->count + 1, parent->children + slot + 1);
+    parent->count--;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::Node *BTree<kT, vT, Compare, NodeSize>::copy_node(const Node *other, Leaf *&last)
+{
+    if (other->leaf)
+    {
+        const Leaf *o = static_cast<const Leaf*>(other);
+        Leaf *copied = this->leaves.create();
+        std::copy(o->keys, o->keys + o->count, copied->keys);
+        std::copy(o->values, o->values + o->count, copied->values);
+        copied->count = o->count;
+
+        // leaves are copied from left to right, so the list is built in order
+        (last == nullptr ? this->first : last->next) = copied;
+        last = copied;
+        return copied;
+    }
+
+    const Inner *o = static_cast<const Inner*>(other);
+    Inner *copied = this->inners.create();
+    std::copy(o->keys, o->keys + o->count, copied->keys);
+    for (std::size_t i = 0; i <= o->count; i++)
+    {
+        copied->children[i] = this->copy_node(o->children[i], last);
+    }
+    copied->count = o->count;
+    return copied;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+void BTree<kT, vT, Compare, NodeSize>::destroy_all(Node *node)
+{
+    if (node->leaf)
+    {
+        this->leaves.destroy(static_cast<Leaf*>(node));
+        return;
+    }
+
+    Inner *inner = static_cast<Inner*>(node);
+    for (std::size_t i = 0; i <= inner->count; i++)
+    {
+        this->destroy_all(inner->children[i]);
+    }
+    this->inners.destroy(inner);
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+void BTree<kT, vT, Compare, NodeSize>::shape_node(const Node *node, std::size_t depth, tree_shape &result) const
+{
+    if (result.histogram.size() < depth)
+    {
+        result.histogram.push_back(0);
+    }
+    result.histogram[depth - 1]++;
+    result.total_path_length += depth;
+    result.size++;
+
+    if (!node->leaf)
+    {
+        const Inner *inner = static_cast<const Inner*>(node);
+        for (std::size_t i = 0; i <= inner->count; i++)
+        {
+            this->shape_node(inner->children[i], depth + 1, result);
+        }
+    }
+}
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+bool BTree<kT, vT, Compare, NodeSize>::validate(const Node *node, std::size_t depth,
+    const kT *low, const kT *high, std::size_t &n_entries) const
+{
+    if (node != this->root && node->count < (node->leaf ? LEAF_MIN : INNER_MIN))
+    {
+        LOGV("invalid btree: too few keys in a node");
+        return false;
+    }
+
+    const kT *keys = node->leaf ? static_cast<const Leaf*>(node)->keys : static_cast<const Inner*>(node)->keys;
+    for (std::size_t i = 0; i < node->count; i++)
+    {
+        if ((i > 0 && !key_less(this->comp, keys[i - 1], keys[i])) ||
+            (low != nullptr && key_less(this->comp, keys[i], *low)) ||
+            (high != nullptr && !key_less(this->comp, keys[i], *high)))
+        {
+            LOGV("invalid btree: wrong order of keys");
+            return false;
+        }
+    }
+
+    if (node->leaf)
+    {
+        if (depth != this->_height)
+        {
+            LOGV("invalid btree: leaves at different depths");
+            return false;
+        }
+        n_entries += node->count;
+        return true;
+    }
+
+    const Inner *inner = static_cast<const Inner*>(node);
+    for (std::size_t i = 0; i <= inner->count; i++)
+    {
+        if (!this->validate(inner->children[i], depth + 1,
+                i == 0 ? low : &inner->keys[i - 1],
+                i == inner->count ? high : &inner->keys[i],
+                n_entries))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+bool BTree<kT, vT, Compare, NodeSize>::is_valid() const
+{
+    if (this->root == nullptr)
+    {
+        return this->_size == 0 && this->first == nullptr;
+    }
+
+    std::size_t n_entries = 0;
+    if (!this->validate(this->root, 1, nullptr, nullptr, n_entries) || n_entries != this->_size)
+    {
+        return false;
+    }
+
+    std::size_t n_listed = 0;
+    for (const Leaf *leaf = this->first; leaf != nullptr; leaf = leaf->next)
+    {
+        n_listed += leaf->count;
+    }
+    if (n_listed != this->_size)
+    {
+        LOGV("invalid btree: broken list of leaves");
+        return false;
+    }
+    return true;
+}
+
+#endif
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+BTree<kT, vT, Compare, NodeSize>::BTree():
+    comp(),
+    root(nullptr),
+    first(nullptr),
+    _size(0),
+    _height(0)
+{}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+BTree<kT, vT, Compare, NodeSize>::BTree(const Compare &_comp):
+    comp(_comp),
+    root(nullptr),
+    first(nullptr),
+    _size(0),
+    _height(0)
+{}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+BTree<kT, vT, Compare, NodeSize>::BTree(const BTree<kT, vT, Compare, NodeSize> &other):
+    comp(other.comp),
+    root(nullptr),
+    first(nullptr),
+    _size(other._size),
+    _height(other._height)
+{
+    Leaf *last = nullptr;
+    if (other.root != nullptr)
+    {
+        this->root = this->copy_node(other.root, last);
+    }
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+BTree<kT, vT, Compare, NodeSize> &BTree<kT, vT, Compare, NodeSize>::operator=(const BTree<kT, vT, Compare, NodeSize> &other)
+{
+    if (this != &other)
+    {
+        this->clear();
+        this->comp = other.comp;
+        Leaf *last = nullptr;
+        if (other.root != nullptr)
+        {
+            this->root = this->copy_node(other.root, last);
+        }
+        this->_size = other._size;
+        this->_height = other._height;
+    }
+    return *this;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+BTree<kT, vT, Compare, NodeSize>::BTree(BTree<kT, vT, Compare, NodeSize> &&other):
+    comp(std::move(other.comp)),
+    leaves(std::move(other.leaves)),
+    inners(std::move(other.inners)),
+    root(std::exchange(other.root, nullptr)),
+    first(std::exchange(other.first, nullptr)),
+    _size(std::exchange(other._size, 0)),
+    _height(std::exchange(other._height, 0))
+{}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+BTree<kT, vT, Compare, NodeSize> &BTree<kT, vT, Compare, NodeSize>::operator=(BTree<kT, vT, Compare, NodeSize> &&other)
+{
+    if (this != &other)
+    {
+        this->clear();
+        this->comp = std::move(other.comp);
+        this->leaves = std::move(other.leaves);
+        this->inners = std::move(other.inners);
+        this->root = std::exchange(other.root, nullptr);
+        this->first = std::exchange(other.first, nullptr);
+        this->_size = std::exchange(other._size, 0);
+        this->_height = std::exchange(other._height, 0);
+    }
+    return *this;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+BTree<kT, vT, Compare, NodeSize>::~BTree()
+{
+    this->clear();
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+vT& BTree<kT, vT, Compare, NodeSize>::operator[](const kT &key)
+{
+    auto position = this->emplace_key(key).first;
+    return position.first->values[position.second];
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+vT& BTree<kT, vT, Compare, NodeSize>::operator[](kT &&key)
+{
+    auto position = this->emplace_key(std::move(key)).first;
+    return position.first->values[position.second];
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+bool BTree<kT, vT, Compare, NodeSize>::insert(const kT &key, const vT &value)
+{
+    auto result = this->emplace_key(key, value);
+    if (!result.second)
+    {
+        result.first.first->values[result.first.second] = value;
+    }
+    return result.second;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+bool BTree<kT, vT, Compare, NodeSize>::insert(kT &&key, vT &&value)
+{
+    // arguments are not used unless the entry is inserted
+    auto result = this->emplace_key(std::move(key), std::move(value));
+    if (!result.second)
+    {
+        result.first.first->values[result.first.second] = std::move(value);
+    }
+    return result.second;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+bool BTree<kT, vT, Compare, NodeSize>::find(const kT &key, vT &dst) const
+{
+    auto position = this->search_by_key(key);
+    if (position.first == nullptr)
+    {
+        return false;
+    }
+    dst = position.first->values[position.second];
+    return true;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+const vT *BTree<kT, vT, Compare, NodeSize>::lookup(const kT &key) const
+{
+    auto position = this->search_by_key(key);
+    return position.first == nullptr ? nullptr : &position.first->values[position.second];
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+vT *BTree<kT, vT, Compare, NodeSize>::lookup(const kT &key)
+{
+    auto position = this->search_by_key(key);
+    return position.first == nullptr ? nullptr : &position.first->values[position.second];
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+template <typename F>
+bool BTree<kT, vT, Compare, NodeSize>::find_and(const kT &key, F &&fn) const
+{
+    auto position = this->search_by_key(key);
+    if (position.first == nullptr)
+    {
+        return false;
+    }
+    fn(static_cast<const vT&>(position.first->values[position.second]));
+    return true;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::iterator BTree<kT, vT, Compare, NodeSize>::find(const kT &key)
+{
+    auto position = this->search_by_key(key);
+    return iterator(position.first, position.second);
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::const_iterator BTree<kT, vT, Compare, NodeSize>::find(const kT &key) const
+{
+    return const_cast<BTree<kT, vT, Compare, NodeSize>*>(this)->find(key);
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+bool BTree<kT, vT, Compare, NodeSize>::contains(const kT &key) const
+{
+    return this->search_by_key(key).first != nullptr;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+std::size_t BTree<kT, vT, Compare, NodeSize>::size() const
+{
+    return this->_size;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+bool BTree<kT, vT, Compare, NodeSize>::erase(const kT &key)
+{
+    path_entry path[MAX_HEIGHT];
+    auto [leaf, pos] = this->descend(key, path);
+    if (leaf == nullptr || pos == leaf->count || key_less(this->comp, key, leaf->keys[pos]))
+    {
+        return false;
+    }
+
+    std::move(leaf->keys + pos + 1, leaf->keys + leaf->count, leaf->keys + pos);
+    std::move(leaf->values + pos + 1, leaf->values + leaf->count, leaf->values + pos);
+    leaf->count--;
+    this->_size--;
+
+    // go up while the nodes lack keys
+    Node *node = leaf;
+    for (std::size_t depth = this->_height - 1;
+        depth > 0 && node->count < (node->leaf ? LEAF_MIN : INNER_MIN);
+        depth--)
+    {
+        this->fix_underflow(path[depth - 1].node, path[depth - 1].slot);
+        node = path[depth - 1].node;
+    }
+
+    if (!this->root->leaf && this->root->count == 0)
+    {
+        Inner *old_root = static_cast<Inner*>(this->root);
+        this->root = old_root->children[0];
+        this->inners.destroy(old_root);
+        this->_height--;
+    }
+    else if (this->root->leaf && this->root->count == 0)
+    {
+        this->leaves.destroy(static_cast<Leaf*>(this->root));
+        this->root = nullptr;
+        this->first = nullptr;
+        this->_height = 0;
+    }
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (!this->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+    return true;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+void BTree<kT, vT, Compare, NodeSize>::clear()
+{
+    // nodes only have to be visited to call the destructors of the entries
+    if constexpr (!std::is_trivially_destructible_v<kT> || !std::is_trivially_destructible_v<vT>)
+    {
+        if (this->root != nullptr)
+        {
+            this->destroy_all(this->root);
+        }
+    }
+    this->leaves.release();
+    this->inners.release();
+    this->root = nullptr;
+    this->first = nullptr;
+    this->_size = 0;
+    this->_height = 0;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+std::size_t BTree<kT, vT, Compare, NodeSize>::depth() const
+{
+    return this->_height;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+tree_shape BTree<kT, vT, Compare, NodeSize>::shape() const
+{
+    tree_shape result{};
+    if (this->root != nullptr)
+    {
+        this->shape_node(this->root, 1, result);
+    }
+    result.height = result.histogram.size();
+    return result;
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+FrozenTree<kT, vT, Compare> BTree<kT, vT, Compare, NodeSize>::freeze() const
+{
+    return FrozenTree<kT, vT, Compare>(this->begin(), this->end(), this->comp);
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::iterator BTree<kT, vT, Compare, NodeSize>::begin()
+{
+    return iterator(this->first, 0);
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::iterator BTree<kT, vT, Compare, NodeSize>::end()
+{
+    return iterator(nullptr, 0);
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::const_iterator BTree<kT, vT, Compare, NodeSize>::begin() const
+{
+    return const_cast<BTree<kT, vT, Compare, NodeSize>*>(this)->begin();
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::const_iterator BTree<kT, vT, Compare, NodeSize>::end() const
+{
+    return const_cast<BTree<kT, vT, Compare, NodeSize>*>(this)->end();
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::const_iterator BTree<kT, vT, Compare, NodeSize>::cbegin() const
+{
+    return this->begin();
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::const_iterator BTree<kT, vT, Compare, NodeSize>::cend() const
+{
+    return this->end();
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::iterator BTree<kT, vT, Compare, NodeSize>::lower_bound(const kT &key)
+{
+    auto position = this->descend(key, nullptr);
+    return iterator(position.first, position.second);
+}
+
+template <typename kT, typename vT, class Compare, std::size_t NodeSize>
+typename BTree<kT, vT, Compare, NodeSize>::const_iterator BTree<kT, vT, Compare, NodeSize>::lower_bound(const kT &key) const
+{
+    return const_cast<BTree<kT, vT, Compare, NodeSize>*>(this)->lower_bound(key);
+}
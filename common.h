@@ -26,4 +26,16 @@
 
     #define LOGV(msg)
 
+#endif
+
+// Hint the CPU to start loading the cache line at addr (a no-op if the
+// compiler has no builtin for that).
+#if defined __GNUC__ || defined __clang__
+
+    #define PREFETCH(addr) __builtin_prefetch(addr)
+
+#else
+
+    #define PREFETCH(addr)
+
 #endif
\ No newline at end of file
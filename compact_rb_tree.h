@@ -0,0 +1,776 @@
+#pragma once
+
+#include "common.h"
+#include "key_compare.h"
+#include "target_interface.h"
+
+#include <compare>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Red-black tree with a compact node layout (implements the key_value_tree
+// interface, see "target_interface.h").
+//
+// Nodes are kept in one contiguous array (std::vector) and are linked by
+// 32-bit indices into it instead of pointers; the color of a node is packed
+// into the top bit of the index of its parent. For CompactRBTree<int, int> a
+// node takes 20 bytes instead of 40 bytes of RBNode (three pointers, color
+// and height), so much more of the tree fits into the caches. Since the
+// array is dense, a node erased from the middle is replaced by the last one
+// (whose links are fixed), so the tree never has holes and copying it is a
+// plain copy of the array.
+//
+// The price is:
+//  - pointers returned by lookup are invalidated by any insertion or erasure
+//    (nodes move when the array grows or shrinks);
+//  - kT and vT must be move constructible and move assignable;
+//  - the size of the tree is limited to 2^31 - 1;
+//  - there are no cached heights, so depth() is an upper bound: twice the
+//    black height of the tree, which is kept up to date by the fixups (the
+//    exact height is in shape(), which walks the whole tree).
+//
+// Node classes of the BaseTree (see "base.h") could not be used for this:
+// BaseTree accesses the links of the Nodes directly as Node* fields, so
+// neither index links nor tagged pointers fit its Node requirements.
+template <typename kT, typename vT, class Compare = default_compare>
+class CompactRBTree
+{
+private:
+
+    using index_t = std::uint32_t;
+
+    // "null" index; the top bit of parent index holds the color
+    static constexpr index_t NIL = 0x7FFFFFFF;
+    static constexpr index_t RED_BIT = 0x80000000;
+
+    struct Node
+    {
+        kT key;
+        vT value;
+
+        // index of the parent, top bit is set if the node is red
+        index_t parent_color;
+
+        index_t left;
+        index_t right;
+
+        // new nodes are red
+        template <typename K, typename... Args>
+        Node(index_t _parent, K &&_key, Args&&... args):
+            key(std::forward<K>(_key)),
+            value(std::forward<Args>(args)...),
+            parent_color(_parent | RED_BIT),
+            left(NIL),
+            right(NIL)
+        {}
+    };
+
+    [[no_unique_address]] Compare comp;
+
+    std::vector<Node> nodes;
+
+    index_t root;
+
+    // number of black nodes on every path from the root down to NIL
+    std::size_t black_height;
+
+    index_t parent(index_t node) const { return this->nodes[node].parent_color & ~RED_BIT; }
+
+    void set_parent(index_t node, index_t parent)
+    {
+        index_t &pc = this->nodes[node].parent_color;
+        pc = (pc & RED_BIT) | parent;
+    }
+
+    // NIL is black
+    bool is_red(index_t node) const
+    {
+        return node != NIL && (this->nodes[node].parent_color & RED_BIT) != 0;
+    }
+
+    void set_red(index_t node, bool red)
+    {
+        index_t &pc = this->nodes[node].parent_color;
+        pc = red ? (pc | RED_BIT) : (pc & ~RED_BIT);
+    }
+
+    // Index of the node with the key or NIL if there is none.
+    template <typename K>
+    index_t search_by_key(const K &key) const;
+
+    // Insert a node with the key constructed from key and the value
+    // constructed in place from args if the key is absent.
+    // Returns the index of the node with the key and true if it has been
+    // inserted.
+    template <typename K, typename... Args>
+    std::pair<index_t, bool> emplace_key(K &&key, Args&&... args);
+
+    void rotate_left(index_t node);
+    void rotate_right(index_t node);
+
+    // make the parent of node point to replacement instead (replacement may
+    // be NIL)
+    void replace_with(index_t node, index_t replacement);
+
+    void fix_insert(index_t node);
+    void fix_erase(index_t node, index_t parent);
+
+    // Unlink the node from the tree (restoring the balance) and free its
+    // place in the array.
+    void erase_at(index_t node);
+
+    // Move the last node of the array into the (unlinked) place and shrink
+    // the array.
+    void remove_slot(index_t place);
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+    // Black height of the subtree or 0 if it is invalid.
+    std::size_t validate(index_t node, index_t parent) const;
+
+#endif
+
+public:
+
+    using key_type = kT;
+    using mapped_type = vT;
+
+    CompactRBTree();
+
+    explicit CompactRBTree(const Compare &_comp);
+
+    vT& operator[](const kT &key);
+    vT& operator[](kT &&key);
+
+    bool insert(const kT &key, const vT &value);
+    bool insert(kT &&key, vT &&value);
+
+    bool find(const kT &key, vT &dst) const;
+
+    // Pointer to the value is valid until the next modification of the tree.
+    const vT *lookup(const kT &key) const;
+    vT *lookup(const kT &key);
+
+    template <typename F>
+    bool find_and(const kT &key, F &&fn) const;
+
+    bool contains(const kT &key) const;
+
+    std::size_t size() const;
+
+    bool erase(const kT &key);
+
+    void clear();
+
+    // Reserve the memory for n nodes.
+    void reserve(std::size_t n);
+
+    // Upper bound of the height (see above).
+    std::size_t depth() const;
+
+    tree_shape shape() const;
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+    bool is_valid() const;
+
+#endif
+};
+
+static_assert(key_value_tree<CompactRBTree<int, int>>);
+
+
+template <typename kT, typename vT, class Compare>
+template <typename K>
+typename CompactRBTree<kT, vT, Compare>::index_t CompactRBTree<kT, vT, Compare>::search_by_key(const K &key) const
+{
+    index_t current = this->root;
+    while (current != NIL)
+    {
+        const Node &node = this->nodes[current];
+        auto order = key_order(this->comp, key, node.key);
+        if (order == 0)
+        {
+            return current;
+        }
+        current = order < 0 ? node.left : node.right;
+    }
+    return NIL;
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename K, typename... Args>
+std::pair<typename CompactRBTree<kT, vT, Compare>::index_t, bool>
+CompactRBTree<kT, vT, Compare>::emplace_key(K &&key, Args&&... args)
+{
+    index_t parent = NIL;
+    bool right = false;
+    for (index_t current = this->root; current != NIL; )
+    {
+        auto order = key_order(this->comp, key, this->nodes[current].key);
+        if (order == 0)
+        {
+            return { current, false };
+        }
+        parent = current;
+        right = order > 0;
+        current = right ? this->nodes[current].right : this->nodes[current].left;
+    }
+
+    if (this->nodes.size() >= NIL)
+    {
+        throw std::length_error("CompactRBTree is full");
+    }
+    index_t inserted = this->nodes.size();
+    this->nodes.emplace_back(parent, std::forward<K>(key), std::forward<Args>(args)...);
+    if (parent == NIL)
+    {
+        this->root = inserted;
+    }
+    else
+    {
+        (right ? this->nodes[parent].right : this->nodes[parent].left) = inserted;
+    }
+    this->fix_insert(inserted);
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (!this->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+    return { inserted, true };
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::rotate_left(index_t node)
+{
+    index_t pivot = this->nodes[node].right;
+    index_t inner = this->nodes[pivot].left;
+
+    this->nodes[node].right = inner;
+    if (inner != NIL)
+    {
+        this->set_parent(inner, node);
+    }
+
+    this->replace_with(node, pivot);
+    if (this->root == node)
+    {
+        this->root = pivot;
+    }
+
+    this->nodes[pivot].left = node;
+    this->set_parent(node, pivot);
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::rotate_right(index_t node)
+{
+    index_t pivot = this->nodes[node].left;
+    index_t inner = this->nodes[pivot].right;
+
+    this->nodes[node].left = inner;
+    if (inner != NIL)
+    {
+        this->set_parent(inner, node);
+    }
+
+    this->replace_with(node, pivot);
+    if (this->root == node)
+    {
+        this->root = pivot;
+    }
+
+    this->nodes[pivot].right = node;
+    this->set_parent(node, pivot);
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::replace_with(index_t node, index_t replacement)
+{
+    index_t parent = this->parent(node);
+    if (replacement != NIL)
+    {
+        this->set_parent(replacement, parent);
+    }
+
+    if (parent == NIL)
+    {
+        return;
+    }
+    Node &p = this->nodes[parent];
+    (p.left == node ? p.left : p.right) = replacement;
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::fix_insert(index_t node)
+{
+    // node is red; while its parent is red too, the parent is not the root
+    // and the grandparent exists
+    while (this->is_red(this->parent(node)))
+    {
+        index_t parent = this->parent(node);
+        index_t grandparent = this->parent(parent);
+        bool parent_is_left = this->nodes[grandparent].left == parent;
+        index_t uncle = parent_is_left ? this->nodes[grandparent].right : this->nodes[grandparent].left;
+
+        if (this->is_red(uncle))
+        {
+            // recolor and go up
+            this->set_red(parent, false);
+            this->set_red(uncle, false);
+            this->set_red(grandparent, true);
+            node = grandparent;
+            continue;
+        }
+
+        if (parent_is_left)
+        {
+            if (this->nodes[parent].right == node)
+            {
+                this->rotate_left(parent);
+                parent = node;
+            }
+            this->rotate_right(grandparent);
+        }
+        else
+        {
+            if (this->nodes[parent].left == node)
+            {
+                this->rotate_right(parent);
+                parent = node;
+            }
+            this->rotate_left(grandparent);
+        }
+        this->set_red(parent, false);
+        this->set_red(grandparent, true);
+        break;
+    }
+    if (this->is_red(this->root))
+    {
+        // a new root or the red one left by the recoloring is made black,
+        // which adds a black node to every path
+        this->black_height++;
+        this->set_red(this->root, false);
+    }
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::erase_at(index_t node)
+{
+    // node that is (possibly) black and takes the place of the removed one,
+    // and its parent (node may be NIL)
+    index_t child, parent;
+    bool removed_black;
+
+    Node &n = this->nodes[node];
+    if (n.left != NIL && n.right != NIL)
+    {
+        // rightmost node from the left subtree takes the place of node
+        index_t predecessor = n.left;
+        while (this->nodes[predecessor].right != NIL)
+        {
+            predecessor = this->nodes[predecessor].right;
+        }
+
+        removed_black = !this->is_red(predecessor);
+        child = this->nodes[predecessor].left;
+        if (this->parent(predecessor) == node)
+        {
+            parent = predecessor;
+        }
+        else
+        {
+            parent = this->parent(predecessor);
+            this->replace_with(predecessor, child);
+            this->nodes[predecessor].left = n.left;
+            this->set_parent(n.left, predecessor);
+        }
+
+        this->replace_with(node, predecessor);
+        this->nodes[predecessor].right = n.right;
+        this->set_parent(n.right, predecessor);
+        this->set_red(predecessor, this->is_red(node));
+        if (this->root == node)
+        {
+            this->root = predecessor;
+        }
+    }
+    else
+    {
+        removed_black = !this->is_red(node);
+        child = n.left != NIL ? n.left : n.right;
+        parent = this->parent(node);
+        this->replace_with(node, child);
+        if (this->root == node)
+        {
+            this->root = child;
+        }
+    }
+
+    if (removed_black)
+    {
+        this->fix_erase(child, parent);
+    }
+    this->remove_slot(node);
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (!this->is_valid())
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::fix_erase(index_t node, index_t parent)
+{
+    // the subtree of node lacks one black node; node is never the root
+    // here, so its sibling exists
+    while (node != this->root && !this->is_red(node))
+    {
+        bool is_left = this->nodes[parent].left == node;
+        index_t sibling = is_left ? this->nodes[parent].right : this->nodes[parent].left;
+
+        if (this->is_red(sibling))
+        {
+            this->set_red(sibling, false);
+            this->set_red(parent, true);
+            if (is_left)
+            {
+                this->rotate_left(parent);
+                sibling = this->nodes[parent].right;
+            }
+            else
+            {
+                this->rotate_right(parent);
+                sibling = this->nodes[parent].left;
+            }
+        }
+
+        index_t near = is_left ? this->nodes[sibling].left : this->nodes[sibling].right;
+        index_t far = is_left ? this->nodes[sibling].right : this->nodes[sibling].left;
+        if (!this->is_red(near) && !this->is_red(far))
+        {
+            // recolor and go up
+            this->set_red(sibling, true);
+            node = parent;
+            parent = this->parent(node);
+            continue;
+        }
+
+        if (!this->is_red(far))
+        {
+            this->set_red(near, false);
+            this->set_red(sibling, true);
+            if (is_left)
+            {
+                this->rotate_right(sibling);
+            }
+            else
+            {
+                this->rotate_left(sibling);
+            }
+            far = sibling;
+            sibling = near;
+        }
+
+        this->set_red(sibling, this->is_red(parent));
+        this->set_red(parent, false);
+        this->set_red(far, false);
+        if (is_left)
+        {
+            this->rotate_left(parent);
+        }
+        else
+        {
+            this->rotate_right(parent);
+        }
+
+        // the lacking black node is restored, the root stays black
+        return;
+    }
+
+    if (this->is_red(node))
+    {
+        this->set_red(node, false);
+    }
+    else
+    {
+        // the lack of a black node went up to the root, i.e. it is shared
+        // by all the paths now
+        this->black_height--;
+    }
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::remove_slot(index_t place)
+{
+    index_t last = this->nodes.size() - 1;
+    if (place != last)
+    {
+        Node &moved = this->nodes[last];
+
+        index_t parent = this->parent(last);
+        if (parent == NIL)
+        {
+            this->root = place;
+        }
+        else
+        {
+            Node &p = this->nodes[parent];
+            (p.left == last ? p.left : p.right) = place;
+        }
+        if (moved.left != NIL)
+        {
+            this->set_parent(moved.left, place);
+        }
+        if (moved.right != NIL)
+        {
+            this->set_parent(moved.right, place);
+        }
+
+        this->nodes[place] = std::move(moved);
+    }
+    this->nodes.pop_back();
+}
+
+template <typename kT, typename vT, class Compare>
+CompactRBTree<kT, vT, Compare>::CompactRBTree():
+    comp(),
+    root(NIL),
+    black_height(0)
+{}
+
+template <typename kT, typename vT, class Compare>
+CompactRBTree<kT, vT, Compare>::CompactRBTree(const Compare &_comp):
+    comp(_comp),
+    root(NIL),
+    black_height(0)
+{}
+
+template <typename kT, typename vT, class Compare>
+vT& CompactRBTree<kT, vT, Compare>::operator[](const kT &key)
+{
+    return this->nodes[this->emplace_key(key).first].value;
+}
+
+template <typename kT, typename vT, class Compare>
+vT& CompactRBTree<kT, vT, Compare>::operator[](kT &&key)
+{
+    return this->nodes[this->emplace_key(std::move(key)).first].value;
+}
+
+template <typename kT, typename vT, class Compare>
+bool CompactRBTree<kT, vT, Compare>::insert(const kT &key, const vT &value)
+{
+    auto result = this->emplace_key(key, value);
+    if (!result.second)
+    {
+        this->nodes[result.first].value = value;
+    }
+    return result.second;
+}
+
+template <typename kT, typename vT, class Compare>
+bool CompactRBTree<kT, vT, Compare>::insert(kT &&key, vT &&value)
+{
+    // arguments are not used unless the node is inserted
+    auto result = this->emplace_key(std::move(key), std::move(value));
+    if (!result.second)
+    {
+        this->nodes[result.first].value = std::move(value);
+    }
+    return result.second;
+}
+
+template <typename kT, typename vT, class Compare>
+bool CompactRBTree<kT, vT, Compare>::find(const kT &key, vT &dst) const
+{
+    index_t found = this->search_by_key(key);
+    if (found == NIL)
+    {
+        return false;
+    }
+    dst = this->nodes[found].value;
+    return true;
+}
+
+template <typename kT, typename vT, class Compare>
+const vT *CompactRBTree<kT, vT, Compare>::lookup(const kT &key) const
+{
+    index_t found = this->search_by_key(key);
+    return found == NIL ? nullptr : &this->nodes[found].value;
+}
+
+template <typename kT, typename vT, class Compare>
+vT *CompactRBTree<kT, vT, Compare>::lookup(const kT &key)
+{
+    index_t found = this->search_by_key(key);
+    return found == NIL ? nullptr : &this->nodes[found].value;
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename F>
+bool CompactRBTree<kT, vT, Compare>::find_and(const kT &key, F &&fn) const
+{
+    index_t found = this->search_by_key(key);
+    if (found == NIL)
+    {
+        return false;
+    }
+    fn(static_cast<const vT&>(this->nodes[found].value));
+    return true;
+}
+
+template <typename kT, typename vT, class Compare>
+bool CompactRBTree<kT, vT, Compare>::contains(const kT &key) const
+{
+    return this->search_by_key(key) != NIL;
+}
+
+template <typename kT, typename vT, class Compare>
+std::size_t CompactRBTree<kT, vT, Compare>::size() const
+{
+    return this->nodes.size();
+}
+
+template <typename kT, typename vT, class Compare>
+bool CompactRBTree<kT, vT, Compare>::erase(const kT &key)
+{
+    index_t found = this->search_by_key(key);
+    if (found == NIL)
+    {
+        return false;
+    }
+    this->erase_at(found);
+    return true;
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::clear()
+{
+    this->nodes.clear();
+    this->root = NIL;
+    this->black_height = 0;
+}
+
+template <typename kT, typename vT, class Compare>
+void CompactRBTree<kT, vT, Compare>::reserve(std::size_t n)
+{
+    this->nodes.reserve(n);
+}
+
+template <typename kT, typename vT, class Compare>
+std::size_t CompactRBTree<kT, vT, Compare>::depth() const
+{
+    // a path has no more red nodes than black ones (the root is black)
+    return 2 * this->black_height;
+}
+
+template <typename kT, typename vT, class Compare>
+tree_shape CompactRBTree<kT, vT, Compare>::shape() const
+{
+    tree_shape result{};
+
+    // depth-first walk using parent links (see BaseTree::shape)
+    index_t current = this->root, previous = NIL;
+    std::size_t depth = 1;
+    while (current != NIL)
+    {
+        const Node &node = this->nodes[current];
+        index_t parent = this->parent(current);
+        index_t next;
+        if (previous == parent)
+        {
+            // first visit
+            if (result.histogram.size() < depth)
+            {
+                result.histogram.push_back(0);
+            }
+            result.histogram[depth - 1]++;
+            result.total_path_length += depth;
+            result.size++;
+
+            next = node.left != NIL ? node.left :
+                (node.right != NIL ? node.right : parent);
+        }
+        else if (previous == node.left && node.right != NIL)
+        {
+            next = node.right;
+        }
+        else
+        {
+            next = parent;
+        }
+
+        depth = next == parent ? depth - 1 : depth + 1;
+        previous = current;
+        current = next;
+    }
+
+    result.height = result.histogram.size();
+    return result;
+}
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+template <typename kT, typename vT, class Compare>
+std::size_t CompactRBTree<kT, vT, Compare>::validate(index_t node, index_t parent) const
+{
+    if (node == NIL)
+    {
+        return 1;
+    }
+
+    const Node &n = this->nodes[node];
+    if (this->parent(node) != parent)
+    {
+        LOGV("invalid compact rbtree: wrong parent link");
+        return 0;
+    }
+    if (this->is_red(node) && (this->is_red(n.left) || this->is_red(n.right)))
+    {
+        LOGV("invalid compact rbtree: red node has a red child");
+        return 0;
+    }
+    if ((n.left != NIL && !key_less(this->comp, this->nodes[n.left].key, n.key)) ||
+        (n.right != NIL && !key_less(this->comp, n.key, this->nodes[n.right].key)))
+    {
+        LOGV("invalid compact rbtree: wrong order of keys");
+        return 0;
+    }
+
+    std::size_t left_h = this->validate(n.left, node);
+    std::size_t right_h = this->validate(n.right, node);
+    if (left_h == 0 || left_h != right_h)
+    {
+        LOGV("invalid compact rbtree: different black heights");
+        return 0;
+    }
+    return left_h + (this->is_red(node) ? 0 : 1);
+}
+
+template <typename kT, typename vT, class Compare>
+bool CompactRBTree<kT, vT, Compare>::is_valid() const
+{
+    if (this->is_red(this->root))
+    {
+        LOGV("invalid compact rbtree: red root");
+        return false;
+    }
+    // validate counts NIL as a black node
+    if (this->validate(this->root, NIL) != this->black_height + 1)
+    {
+        LOGV("invalid compact rbtree: wrong black height of the root");
+        return false;
+    }
+    return true;
+}
+
+#endif
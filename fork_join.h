@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <future>
+#include <thread>
+#include <utility>
+
+// Minimal fork-join parallelism for divide-and-conquer algorithms on trees
+// (see e.g. BaseTree::set_union). Recursive calls fork while they are given
+// a positive depth (one less at every level), so the number of tasks is
+// bounded by a power of 2 and there is no need for a shared scheduler.
+
+
+// Depth of forks that gives every hardware thread a task (0 if there is only
+// one).
+inline unsigned fork_depth()
+{
+    unsigned n_threads = std::thread::hardware_concurrency();
+    return n_threads <= 1 ? 0 : std::bit_width(n_threads - 1);
+}
+
+// Run f and g and wait for both of them to finish. If fork is true, f runs on
+// a new thread while g runs on the calling one, otherwise they run one after
+// another. Exceptions thrown by f are rethrown after g is done.
+template <typename F, typename G>
+void fork_join(bool fork, F &&f, G &&g)
+{
+    if (!fork)
+    {
+        f();
+        g();
+        return;
+    }
+    auto forked = std::async(std::launch::async, std::forward<F>(f));
+    g();
+    forked.get();
+}
+
+// Same as std::stable_sort, but halves of the range are sorted in parallel
+// (forks levels deep, see above) and then merged.
+template <typename RandomIt, typename Less>
+void parallel_stable_sort(RandomIt first, RandomIt last, Less less, unsigned forks)
+{
+    // smaller ranges are not worth a thread
+    constexpr std::ptrdiff_t MIN_FORKED = 1 << 14;
+
+    if (forks == 0 || last - first < 2 * MIN_FORKED)
+    {
+        std::stable_sort(first, last, less);
+        return;
+    }
+    RandomIt middle = first + (last - first) / 2;
+    fork_join(true,
+        [&]() { parallel_stable_sort(first, middle, less, forks - 1); },
+        [&]() { parallel_stable_sort(middle, last, less, forks - 1); });
+    std::inplace_merge(first, middle, last, less);
+}
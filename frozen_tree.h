@@ -0,0 +1,345 @@
+#pragma once
+
+#include "common.h"
+#include "key_compare.h"
+#include "target_interface.h"
+
+#include <algorithm>
+#include <bit>
+#include <compare>
+#include <cstddef>
+#include <new>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Immutable snapshot of a key-value tree (implements the key_value_reader
+// interface, see "target_interface.h"); see e.g. BaseTree::freeze.
+//
+// Keys are stored in an array in the Eytzinger layout: the implicit complete
+// binary search tree is laid out level by level, the children of the node i
+// (numbering from 1) are the nodes 2i and 2i + 1, and the node i is at the
+// index i (the array starts with a padding key). Values are kept in a
+// parallel array, so the search only touches the keys. The top levels of the
+// tree share a few cache lines, and the search loop has no branches that
+// depend on the keys: it prefetches the descendants a few levels down while
+// comparing and tells if the key is found only at the end.
+// Allocator for the keys of FrozenTree: aligns the arrays to cache lines.
+template <typename T>
+struct cache_aligned_allocator
+{
+    using value_type = T;
+
+    static constexpr std::align_val_t ALIGNMENT{alignof(T) > 64 ? alignof(T) : 64};
+
+    cache_aligned_allocator() = default;
+
+    template <typename U>
+    cache_aligned_allocator(const cache_aligned_allocator<U> &) {}
+
+    T *allocate(std::size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), ALIGNMENT));
+    }
+
+    void deallocate(T *ptr, std::size_t)
+    {
+        ::operator delete(ptr, ALIGNMENT);
+    }
+
+    template <typename U>
+    bool operator==(const cache_aligned_allocator<U> &) const
+    {
+        return true;
+    }
+};
+
+template <typename kT, typename vT, class Compare = default_compare>
+class FrozenTree
+{
+private:
+
+    // descendants of the node i at the depth of log2(PREFETCH_STRIDE) below
+    // it are the PREFETCH_STRIDE nodes from the index PREFETCH_STRIDE * i;
+    // since the keys start at a cache line, they fill exactly one cache line
+    // if the size of kT is a power of 2 (for other sizes the prefetch covers
+    // most of them)
+    static constexpr std::size_t PREFETCH_STRIDE = sizeof(kT) < 64 ? std::bit_floor(64 / sizeof(kT)) : 1;
+
+    [[no_unique_address]] Compare comp;
+
+    // keys[i] and values[i - 1] belong to the node i (keys[0] is a copy of
+    // keys[1] if the tree is not empty)
+    std::vector<kT, cache_aligned_allocator<kT>> keys;
+    std::vector<vT> values;
+
+    // In-order traversal of the implicit tree of n nodes from the node i:
+    // order[i - 1] is set to the position of the node in sorted order.
+    // Returns the next position.
+    static std::size_t sorted_positions(std::vector<std::size_t> &order, std::size_t i,
+        std::size_t position);
+
+    // number of searches advanced together by find_batch
+    static constexpr std::size_t BATCH_GROUP = 16;
+
+    // Number of the node with the key or 0 if there is none.
+    template <typename K>
+    std::size_t search_by_key(const K &key) const;
+
+    // Number of the node with the key or 0 if there is none, given the
+    // index i where the search for it went past the bottom of the tree.
+    template <typename K>
+    std::size_t resolve(std::size_t i, const K &key) const;
+
+public:
+
+    using key_type = kT;
+    using mapped_type = vT;
+
+    FrozenTree();
+
+    // Construct a snapshot from the items (pairs of key and value) in
+    // [first, last), which must be sorted by keys without duplicates (e.g.
+    // the range of a tree).
+    template <typename InputIt>
+    FrozenTree(InputIt first, InputIt last, const Compare &_comp = Compare());
+
+    bool find(const kT &key, vT &dst) const;
+
+    const vT *lookup(const kT &key) const;
+
+    template <typename F>
+    bool find_and(const kT &key, F &&fn) const;
+
+    bool contains(const kT &key) const;
+
+    // Lookup all the keys at once (see BaseTree::find_batch). All the
+    // searches take the same number of steps, so they advance in lockstep.
+    std::size_t find_batch(std::span<const kT> keys, std::span<const vT*> out) const;
+
+    // Heterogeneous lookups (see BaseTree).
+    template <typename K> requires lookup_key<Compare, K, kT>
+    const vT *lookup(const K &key) const;
+
+    template <typename K> requires lookup_key<Compare, K, kT>
+    bool contains(const K &key) const;
+
+    std::size_t size() const;
+
+    std::size_t depth() const;
+
+    tree_shape shape() const;
+};
+
+static_assert(key_value_reader<FrozenTree<int, int>>);
+
+
+template <typename kT, typename vT, class Compare>
+std::size_t FrozenTree<kT, vT, Compare>::sorted_positions(std::vector<std::size_t> &order,
+    std::size_t i, std::size_t position)
+{
+    if (i > order.size())
+    {
+        return position;
+    }
+    position = sorted_positions(order, 2 * i, position);
+    order[i - 1] = position++;
+    return sorted_positions(order, 2 * i + 1, position);
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename K>
+std::size_t FrozenTree<kT, vT, Compare>::search_by_key(const K &key) const
+{
+    const kT *k = this->keys.data();
+    std::size_t n = this->values.size();
+
+    // go right when the node is less than the key; the last node where the
+    // search went left is the first one not less than the key
+    std::size_t i = 1;
+    while (i <= n)
+    {
+        if (PREFETCH_STRIDE * i <= n)
+        {
+            PREFETCH(k + PREFETCH_STRIDE * i);
+        }
+        i = 2 * i + key_less(this->comp, k[i], key);
+    }
+    return this->resolve(i, key);
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename K>
+std::size_t FrozenTree<kT, vT, Compare>::resolve(std::size_t i, const K &key) const
+{
+    // the path to i turned right at every node below the last one where it
+    // turned left (which is the first node not less than the key)
+    i >>= std::countr_one(i) + 1;
+
+    if (i == 0 || key_less(this->comp, key, this->keys[i]))
+    {
+        return 0;
+    }
+    return i;
+}
+
+template <typename kT, typename vT, class Compare>
+FrozenTree<kT, vT, Compare>::FrozenTree():
+    comp()
+{}
+
+template <typename kT, typename vT, class Compare>
+template <typename InputIt>
+FrozenTree<kT, vT, Compare>::FrozenTree(InputIt first, InputIt last, const Compare &_comp):
+    comp(_comp)
+{
+    std::vector<kT> sorted_keys;
+    std::vector<vT> sorted_values;
+    for (; first != last; ++first)
+    {
+        auto &&item = *first;
+        sorted_keys.push_back(item.first);
+        sorted_values.push_back(item.second);
+    }
+
+    std::vector<std::size_t> order(sorted_keys.size());
+    sorted_positions(order, 1, 0);
+
+    if (order.empty())
+    {
+        return;
+    }
+    this->keys.reserve(order.size() + 1);
+    this->values.reserve(order.size());
+    this->keys.push_back(sorted_keys[order[0]]);
+    for (std::size_t position : order)
+    {
+        this->keys.push_back(std::move(sorted_keys[position]));
+        this->values.push_back(std::move(sorted_values[position]));
+    }
+}
+
+template <typename kT, typename vT, class Compare>
+bool FrozenTree<kT, vT, Compare>::find(const kT &key, vT &dst) const
+{
+    std::size_t i = this->search_by_key(key);
+    if (i == 0)
+    {
+        return false;
+    }
+    dst = this->values[i - 1];
+    return true;
+}
+
+template <typename kT, typename vT, class Compare>
+const vT *FrozenTree<kT, vT, Compare>::lookup(const kT &key) const
+{
+    std::size_t i = this->search_by_key(key);
+    return i == 0 ? nullptr : &this->values[i - 1];
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename F>
+bool FrozenTree<kT, vT, Compare>::find_and(const kT &key, F &&fn) const
+{
+    std::size_t i = this->search_by_key(key);
+    if (i == 0)
+    {
+        return false;
+    }
+    fn(this->values[i - 1]);
+    return true;
+}
+
+template <typename kT, typename vT, class Compare>
+bool FrozenTree<kT, vT, Compare>::contains(const kT &key) const
+{
+    return this->search_by_key(key) != 0;
+}
+
+template <typename kT, typename vT, class Compare>
+std::size_t FrozenTree<kT, vT, Compare>::find_batch(std::span<const kT> keys, std::span<const vT*> out) const
+{
+    const kT *k = this->keys.data();
+    std::size_t n = this->values.size();
+
+    std::size_t found = 0;
+    for (std::size_t first = 0; first < keys.size(); first += BATCH_GROUP)
+    {
+        std::size_t m = std::min(BATCH_GROUP, keys.size() - first);
+
+        std::size_t index[BATCH_GROUP];
+        std::fill(index, index + m, 1);
+
+        // the deepest searches take depth() steps, the others one less
+        for (std::size_t level = this->depth(); level > 0; level--)
+        {
+            for (std::size_t j = 0; j < m; j++)
+            {
+                std::size_t i = index[j];
+                if (i <= n)
+                {
+                    i = 2 * i + key_less(this->comp, k[i], keys[first + j]);
+                    if (i <= n)
+                    {
+                        PREFETCH(k + i);
+                    }
+                    index[j] = i;
+                }
+            }
+        }
+
+        for (std::size_t j = 0; j < m; j++)
+        {
+            std::size_t i = this->resolve(index[j], keys[first + j]);
+            out[first + j] = i == 0 ? nullptr : &this->values[i - 1];
+            found += i != 0;
+        }
+    }
+    return found;
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename K> requires lookup_key<Compare, K, kT>
+const vT *FrozenTree<kT, vT, Compare>::lookup(const K &key) const
+{
+    std::size_t i = this->search_by_key(key);
+    return i == 0 ? nullptr : &this->values[i - 1];
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename K> requires lookup_key<Compare, K, kT>
+bool FrozenTree<kT, vT, Compare>::contains(const K &key) const
+{
+    return this->search_by_key(key) != 0;
+}
+
+template <typename kT, typename vT, class Compare>
+std::size_t FrozenTree<kT, vT, Compare>::size() const
+{
+    return this->values.size();
+}
+
+template <typename kT, typename vT, class Compare>
+std::size_t FrozenTree<kT, vT, Compare>::depth() const
+{
+    return std::bit_width(this->values.size());
+}
+
+template <typename kT, typename vT, class Compare>
+tree_shape FrozenTree<kT, vT, Compare>::shape() const
+{
+    // the tree is complete: every level is full except for the last one
+    tree_shape result{};
+    result.size = this->values.size();
+    result.height = this->depth();
+    std::size_t remaining = result.size;
+    for (std::size_t depth = 1; depth <= result.height; depth++)
+    {
+        std::size_t level = std::min(remaining, std::size_t(1) << (depth - 1));
+        result.histogram.push_back(level);
+        result.total_path_length += level * depth;
+        remaining -= level;
+    }
+    return result;
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "common.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Interleaved lookups with C++20 coroutines. A lookup coroutine (e.g.
+// BaseTree::lookup_coro) prefetches the next node and suspends instead of
+// waiting for it to be loaded; interleave() keeps many such lookups in
+// flight and resumes them in turn, so by the time a lookup is resumed its
+// node is (hopefully) in the cache, and memory latency of independent
+// lookups overlaps without any hand-written batching.
+
+
+// Recycles the memory of coroutine frames (per thread), so that starting a
+// lookup does not go to the general-purpose allocator. Only frames of one
+// size (the first one freed) are kept, which is enough for a scheduler
+// running one kind of lookups, and at most MAX_BLOCKS of them, so a single
+// large batch does not hold on to its frames for the life of the thread. The
+// kept frames are freed when the thread exits.
+class frame_cache
+{
+private:
+
+    struct block
+    {
+        block *next;
+    };
+
+    static constexpr std::size_t MAX_BLOCKS = 64;
+
+    block *free_list = nullptr;
+    std::size_t block_size = 0;
+    std::size_t n_blocks = 0;
+
+    frame_cache() = default;
+
+    ~frame_cache()
+    {
+        while (this->free_list != nullptr)
+        {
+            block *b = this->free_list;
+            this->free_list = b->next;
+            ::operator delete(b);
+        }
+    }
+
+    // the cache of the calling thread
+    static frame_cache &local()
+    {
+        static thread_local frame_cache cache;
+        return cache;
+    }
+
+public:
+
+    frame_cache(const frame_cache &) = delete;
+    frame_cache &operator=(const frame_cache &) = delete;
+
+    static void *allocate(std::size_t size)
+    {
+        frame_cache &cache = local();
+        if (size == cache.block_size && cache.free_list != nullptr)
+        {
+            block *b = cache.free_list;
+            cache.free_list = b->next;
+            cache.n_blocks--;
+            return b;
+        }
+        return ::operator new(size);
+    }
+
+    static void deallocate(void *ptr, std::size_t size)
+    {
+        frame_cache &cache = local();
+        if (cache.block_size == 0)
+        {
+            cache.block_size = size;
+        }
+        if (size != cache.block_size || cache.n_blocks == MAX_BLOCKS)
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        block *b = static_cast<block*>(ptr);
+        b->next = cache.free_list;
+        cache.free_list = b;
+        cache.n_blocks++;
+    }
+};
+
+
+// Coroutine performing a lookup that results in a T. It is created
+// suspended and must be resumed until it is done.
+template <typename T>
+class lookup_task
+{
+public:
+
+    struct promise_type
+    {
+        T result;
+
+        lookup_task get_return_object()
+        {
+            return lookup_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_value(T value) { this->result = std::move(value); }
+
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(std::size_t size) { return frame_cache::allocate(size); }
+        static void operator delete(void *ptr, std::size_t size) { frame_cache::deallocate(ptr, size); }
+    };
+
+private:
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit lookup_task(std::coroutine_handle<promise_type> _handle): handle(_handle) {}
+
+public:
+
+    lookup_task(): handle(nullptr) {}
+
+    lookup_task(const lookup_task<T> &) = delete;
+    lookup_task<T> &operator=(const lookup_task<T> &) = delete;
+
+    lookup_task(lookup_task<T> &&other): handle(std::exchange(other.handle, nullptr)) {}
+
+    lookup_task<T> &operator=(lookup_task<T> &&other)
+    {
+        if (this != &other)
+        {
+            if (this->handle)
+            {
+                this->handle.destroy();
+            }
+            this->handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~lookup_task()
+    {
+        if (this->handle)
+        {
+            this->handle.destroy();
+        }
+    }
+
+    bool done() const { return this->handle.done(); }
+
+    void resume() const { this->handle.resume(); }
+
+    // Valid once the task is done.
+    const T &result() const { return this->handle.promise().result; }
+};
+
+
+// Awaitable that prefetches the memory at addr and suspends the coroutine.
+struct prefetch_and_suspend
+{
+    const void *addr;
+
+    bool await_ready() const noexcept
+    {
+        PREFETCH(this->addr);
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+
+    void await_resume() const noexcept {}
+};
+
+
+// Run lookup(keys[i]) (which must return a lookup_task) for every key,
+// keeping up to width lookups in flight and resuming them round-robin;
+// the result of the lookup of keys[i] is written to out[i]. Keys and Out are
+// random access ranges (e.g. vectors or spans), out must be at least as long
+// as keys.
+template <typename Lookup, typename Keys, typename Out>
+void interleave(Lookup &&lookup, const Keys &keys, Out &&out, std::size_t width = 16)
+{
+    struct in_flight
+    {
+        std::invoke_result_t<Lookup&, decltype(keys[0])> task;
+        std::size_t index;
+    };
+
+    std::vector<in_flight> slots;
+    slots.reserve(width);
+    std::size_t next = 0;
+    for (; next < keys.size() && slots.size() < width; next++)
+    {
+        slots.push_back({ lookup(keys[next]), next });
+    }
+
+    while (!slots.empty())
+    {
+        for (std::size_t i = 0; i < slots.size(); )
+        {
+            in_flight &slot = slots[i];
+            slot.task.resume();
+            if (!slot.task.done())
+            {
+                i++;
+                continue;
+            }
+
+            out[slot.index] = slot.task.result();
+            if (next < keys.size())
+            {
+                // the finished lookup is replaced with a new one
+                slot.task = lookup(keys[next]);
+                slot.index = next++;
+                i++;
+            }
+            else
+            {
+                slot = std::move(slots.back());
+                slots.pop_back();
+            }
+        }
+    }
+}
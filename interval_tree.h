@@ -0,0 +1,15 @@
+#pragma once
+
+#include "augment.h"
+#include "rb_tree.h"
+
+// Interval tree: a red-black tree whose keys are intervals (see interval in
+// "augment.h") and every Node keeps the greatest end of the intervals in its
+// subtree (interval_augment), which is maintained by the rotations and
+// deletion like the height. Besides the usual operations with intervals as
+// keys (there may be only one item for every interval), it finds all the
+// intervals that overlap a given one with for_each_overlapping.
+template <typename T, typename vT>
+using IntervalTree = RBTree<interval<T>, vT, default_compare, interval_augment<T>>;
+
+static_assert(key_value_tree<IntervalTree<int, int>>);
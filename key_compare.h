@@ -0,0 +1,84 @@
+#pragma once
+
+#include <compare>
+#include <concepts>
+#include <functional>
+#include <type_traits>
+
+// Utilities for comparing keys with a user-provided comparator. Comparator
+// may be either:
+//  - three-way (like the default_compare below), i.e. return one of
+//    the std::*_ordering types; then a single call is enough to tell if the
+//    keys are equal or which one is less;
+//  - a "less" predicate (like std::less<kT>) returning bool; then telling
+//    equal keys apart requires a second call with swapped arguments.
+// If the comparator defines is_transparent type, trees allow lookups with any
+// key type it accepts (e.g. std::string_view for std::string keys).
+
+template <class Compare, typename A, typename B>
+constexpr bool is_less_predicate = std::is_convertible_v<
+    std::invoke_result_t<const Compare&, const A&, const B&>, bool>;
+
+// The default comparator of the trees: compares keys with operator<=> if
+// they have it (one comparison per node on the way down), and with operator<
+// otherwise (like std::less, but still three-way, so it costs one or two
+// calls of operator<). Transparent like std::compare_three_way.
+struct default_compare
+{
+    using is_transparent = void;
+
+    template <typename A, typename B>
+        requires std::three_way_comparable_with<A, B> || requires(const A &a, const B &b)
+        {
+            { a < b } -> std::convertible_to<bool>;
+            { b < a } -> std::convertible_to<bool>;
+        }
+    constexpr auto operator()(const A &a, const B &b) const
+    {
+        if constexpr (std::three_way_comparable_with<A, B>)
+        {
+            return std::compare_three_way()(a, b);
+        }
+        else
+        {
+            return a < b ? std::weak_ordering::less :
+                (b < a ? std::weak_ordering::greater : std::weak_ordering::equivalent);
+        }
+    }
+};
+
+// Keys of type K may be used to lookup in a tree with kT keys.
+template <class Compare, typename K, typename kT>
+concept lookup_key = requires { typename Compare::is_transparent; } &&
+    std::is_invocable_v<const Compare&, const K&, const kT&> &&
+    std::is_invocable_v<const Compare&, const kT&, const K&>;
+
+// Compare a with b. The result may be compared with 0 like the result of
+// operator<=>.
+template <class Compare, typename A, typename B>
+constexpr auto key_order(const Compare &comp, const A &a, const B &b)
+{
+    if constexpr (is_less_predicate<Compare, A, B>)
+    {
+        return comp(a, b) ? std::weak_ordering::less :
+            (comp(b, a) ? std::weak_ordering::greater : std::weak_ordering::equivalent);
+    }
+    else
+    {
+        return comp(a, b);
+    }
+}
+
+// Tell if a is less than b (one call of the comparator in any case).
+template <class Compare, typename A, typename B>
+constexpr bool key_less(const Compare &comp, const A &a, const B &b)
+{
+    if constexpr (is_less_predicate<Compare, A, B>)
+    {
+        return comp(a, b);
+    }
+    else
+    {
+        return comp(a, b) < 0;
+    }
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Node allocation policies for the BaseTree (see "base.h"). A policy for
+// Node class must:
+//  - have a method template Node *create(Args&&... args) which allocates
+//    memory for a Node and constructs it from args;
+//  - have a method void destroy(Node *node) which destroys a Node previously
+//    created by the same instance and frees (or recycles) its memory;
+//  - have a method void release() which frees the memory of all the Nodes
+//    created by the instance at once, without calling their destructors;
+//    policies that are unable to do that must define static constexpr bool
+//    bulk_release = false (and release() should do nothing), otherwise it
+//    must be true;
+//  - be default constructible and movable (copy of a tree always gets a
+//    fresh instance of the policy, so copying is not required);
+//  - [optional] have a method void reserve(std::size_t n) after which the
+//    next n Nodes created (if they do not reuse the memory of destroyed
+//    ones) are placed next to each other, e.g. for copying a tree;
+//  - [optional] have a method void share(const Policy &other) after which
+//    the memory of the Nodes created by other (so far) is also owned by this
+//    instance: such Nodes may be moved to the tree of this instance and be
+//    destroyed by it, and their memory stays valid after other releases
+//    it. Trees need it to exchange Nodes (see BaseTree::split).
+
+
+// Policy that can share Nodes with other instances (see share).
+template <class Alloc>
+concept shared_allocator = requires (Alloc &alloc, const Alloc &other)
+{
+    alloc.share(other);
+};
+
+
+// Policy that allocates every Node separately using new / delete.
+template <class Node>
+struct NewDeleteAllocator
+{
+    static constexpr bool bulk_release = false;
+
+    template <typename... Args>
+    Node *create(Args&&... args)
+    {
+        LOG("[ MEMORY ] Created Node using new.");
+        return new Node(std::forward<Args>(args)...);
+    }
+
+    void destroy(Node *node)
+    {
+        delete node;
+        LOG("[ MEMORY ] Deleted Node.");
+    }
+
+    void release() {}
+
+    // every Node is owned by itself
+    void share(const NewDeleteAllocator<Node> &) {}
+};
+
+
+// Default policy: Nodes are placed in slabs (arrays of slots) of growing
+// size. Destroyed Nodes are put on a free list and their slots are reused
+// by subsequent calls to create. release() drops all the slabs at once, so
+// clearing a tree does not have to free Nodes one by one. Slabs are shared
+// by the pools of the trees that exchanged Nodes (see share) and freed by
+// the last one.
+template <class Node>
+class NodePool
+{
+private:
+
+    union Slot
+    {
+        Slot *next;
+        alignas(Node) unsigned char storage[sizeof(Node)];
+    };
+
+    static constexpr std::size_t MIN_SLAB_SIZE = 32;
+    static constexpr std::size_t MAX_SLAB_SIZE = 1 << 16;
+
+    std::vector<std::shared_ptr<Slot[]>> slabs;
+
+    // head of the list of slots freed by destroy
+    Slot *free_list;
+
+    // [cursor, end) is the untouched part of the last slab
+    Slot *cursor;
+    Slot *end;
+
+    // size of the next slab to be allocated
+    std::size_t next_slab_size;
+
+    Slot *take_slot()
+    {
+        if (this->free_list != nullptr)
+        {
+            Slot *slot = this->free_list;
+            this->free_list = slot->next;
+            return slot;
+        }
+
+        if (this->cursor == this->end)
+        {
+            this->grow(this->next_slab_size);
+            if (this->next_slab_size < MAX_SLAB_SIZE)
+            {
+                this->next_slab_size *= 2;
+            }
+        }
+        return this->cursor++;
+    }
+
+    void grow(std::size_t n_slots)
+    {
+        this->slabs.emplace_back(new Slot[n_slots]);
+        this->cursor = this->slabs.back().get();
+        this->end = this->cursor + n_slots;
+        LOG("[ MEMORY ] Allocated a slab of " << n_slots << " Nodes.");
+    }
+
+public:
+
+    static constexpr bool bulk_release = true;
+
+    NodePool():
+        free_list(nullptr),
+        cursor(nullptr),
+        end(nullptr),
+        next_slab_size(MIN_SLAB_SIZE)
+    {}
+
+    NodePool(const NodePool<Node> &) = delete;
+    NodePool<Node> &operator=(const NodePool<Node> &) = delete;
+
+    NodePool(NodePool<Node> &&other):
+        slabs(std::move(other.slabs)),
+        free_list(std::exchange(other.free_list, nullptr)),
+        cursor(std::exchange(other.cursor, nullptr)),
+        end(std::exchange(other.end, nullptr)),
+        next_slab_size(std::exchange(other.next_slab_size, MIN_SLAB_SIZE))
+    {
+        other.slabs.clear();
+    }
+
+    NodePool<Node> &operator=(NodePool<Node> &&other)
+    {
+        if (this != &other)
+        {
+            this->slabs = std::move(other.slabs);
+            other.slabs.clear();
+            this->free_list = std::exchange(other.free_list, nullptr);
+            this->cursor = std::exchange(other.cursor, nullptr);
+            this->end = std::exchange(other.end, nullptr);
+            this->next_slab_size = std::exchange(other.next_slab_size, MIN_SLAB_SIZE);
+        }
+        return *this;
+    }
+
+    template <typename... Args>
+    Node *create(Args&&... args)
+    {
+        Slot *slot = this->take_slot();
+        try
+        {
+            return ::new (static_cast<void*>(slot->storage)) Node(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            slot->next = this->free_list;
+            this->free_list = slot;
+            throw;
+        }
+    }
+
+    void reserve(std::size_t n)
+    {
+        // the rest of the last slab is left unused if it is too small
+        if (std::size_t(this->end - this->cursor) < n)
+        {
+            this->grow(n);
+        }
+    }
+
+    void destroy(Node *node)
+    {
+        node->~Node();
+        Slot *slot = reinterpret_cast<Slot*>(node);
+        slot->next = this->free_list;
+        this->free_list = slot;
+    }
+
+    // The slabs of other are only freed when both pools are released, even
+    // if one of them has no Nodes there (see BaseTree::join).
+    void share(const NodePool<Node> &other)
+    {
+        // the pools might share some of the slabs already
+        this->slabs.insert(this->slabs.end(), other.slabs.begin(), other.slabs.end());
+        std::sort(this->slabs.begin(), this->slabs.end(),
+            [](const std::shared_ptr<Slot[]> &a, const std::shared_ptr<Slot[]> &b)
+            { return std::less<Slot*>()(a.get(), b.get()); });
+        this->slabs.erase(std::unique(this->slabs.begin(), this->slabs.end()), this->slabs.end());
+        LOG("[ MEMORY ] Shared " << other.slabs.size() << " slabs.");
+    }
+
+    void release()
+    {
+        this->slabs.clear();
+        this->free_list = nullptr;
+        this->cursor = nullptr;
+        this->end = nullptr;
+        this->next_slab_size = MIN_SLAB_SIZE;
+        LOG("[ MEMORY ] Released all slabs.");
+    }
+};
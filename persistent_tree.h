@@ -0,0 +1,720 @@
+#pragma once
+
+#include "common.h"
+#include "key_compare.h"
+#include "target_interface.h"
+
+#include <bit>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Persistent red-black tree: Nodes are never modified after they are
+// created, so insert and erase copy the path from the root to the changed
+// Node (and the few Nodes moved by balancing) and share all the other
+// subtrees with the previous version of the tree.
+//
+// Every write publishes the new version, and snapshot() returns a handle to
+// the latest published one. A Snapshot (implements the key_value_reader
+// interface, see "target_interface.h") is as cheap to take and to copy as a
+// std::shared_ptr, stays the same while the tree changes and may be read by
+// any number of threads without locks (a mutex only guards the pointer to
+// the published version while it is copied or replaced). Nodes are reference
+// counted, so the memory of an old version is freed when nothing uses it
+// anymore. Writes (and reads through the tree itself) must not run
+// concurrently with each other, but snapshot() may be called from any thread
+// at any time.
+//
+// Insertion rebalances on the way up like in Okasaki's functional red-black
+// trees. Deletion joins the subtrees around the erased Node (and the
+// remainders of the path above it) by black heights, which does not need
+// any of the deletion cases of the mutable tree.
+template <typename kT, typename vT, class Compare = default_compare>
+class PersistentRBTree
+{
+private:
+
+    struct Node;
+    using node_ptr = std::shared_ptr<const Node>;
+
+    struct Node
+    {
+        kT key;
+        vT value;
+        node_ptr left;
+        node_ptr right;
+        bool red;
+
+        // number of black Nodes on any path from the Node down to a null
+        // (counting the Node itself)
+        std::uint32_t black_height;
+
+        Node(node_ptr _left, const kT &_key, const vT &_value, node_ptr _right, bool _red):
+            key(_key),
+            value(_value),
+            left(std::move(_left)),
+            right(std::move(_right)),
+            red(_red),
+            black_height((this->left == nullptr ? 0 : this->left->black_height) + !_red)
+        {}
+    };
+
+    // a version of the tree
+    struct version
+    {
+        node_ptr root;
+        std::size_t size = 0;
+    };
+
+public:
+
+    // Immutable version of the tree (see above).
+    class Snapshot
+    {
+    private:
+
+        friend class PersistentRBTree<kT, vT, Compare>;
+
+        std::shared_ptr<const version> state;
+
+        [[no_unique_address]] Compare comp;
+
+        Snapshot(std::shared_ptr<const version> _state, const Compare &_comp);
+
+        // The Node with the key or nullptr.
+        template <typename K>
+        const Node *search_by_key(const K &key) const;
+
+    public:
+
+        using key_type = kT;
+        using mapped_type = vT;
+
+        // empty snapshot
+        Snapshot();
+
+        bool find(const kT &key, vT &dst) const;
+
+        // The ptr stays valid as long as the Snapshot (or a copy of it).
+        const vT *lookup(const kT &key) const;
+
+        template <typename F>
+        bool find_and(const kT &key, F &&fn) const;
+
+        bool contains(const kT &key) const;
+
+        // Heterogeneous lookups (see BaseTree).
+        template <typename K> requires lookup_key<Compare, K, kT>
+        const vT *lookup(const K &key) const;
+
+        template <typename K> requires lookup_key<Compare, K, kT>
+        bool contains(const K &key) const;
+
+        // Call fn(key, value) for every item in order of keys.
+        template <typename F>
+        void for_each(F &&fn) const;
+
+        std::size_t size() const;
+
+        std::size_t depth() const;
+
+        tree_shape shape() const;
+    };
+
+private:
+
+    [[no_unique_address]] Compare comp;
+
+    // the latest version (only the writer uses it) and its copy for the
+    // readers (see snapshot)
+    Snapshot latest;
+    std::shared_ptr<const version> published;
+    mutable std::mutex published_mutex;
+
+    static bool is_red(const node_ptr &node) { return node != nullptr && node->red; }
+
+    static std::uint32_t black_height(const node_ptr &node) { return node == nullptr ? 0 : node->black_height; }
+
+    static node_ptr make_node(bool red, node_ptr left, const kT &key, const vT &value, node_ptr right);
+
+    // Same as make_node, but if the new Node is black and has a red child
+    // with a red child of its own, the three of them are restructured into
+    // a red Node with two black children (the red one may still have a red
+    // parent, which is fixed one level up).
+    static node_ptr balance(bool red, node_ptr left, const kT &key, const vT &value, node_ptr right);
+
+    // The Node itself if it is black, otherwise its black copy.
+    static node_ptr blacken(const node_ptr &node);
+
+    // Join the trees left and right (all the keys of left are less than key
+    // and all the keys of right are greater) with the item in between into
+    // one valid tree (possibly with a red root). join_right (join_left)
+    // requires left (right) to have a black root and the greater black
+    // height.
+    static node_ptr join_right(const node_ptr &left, const kT &key, const vT &value, const node_ptr &right);
+    static node_ptr join_left(const node_ptr &left, const kT &key, const vT &value, const node_ptr &right);
+    static node_ptr join(node_ptr left, const kT &key, const vT &value, node_ptr right);
+
+    // Remove the item with the greatest key from the subtree of node (which
+    // must not be null). Returns the rest of the subtree; last is set to the
+    // removed Node.
+    static node_ptr split_last(const node_ptr &node, const Node *&last);
+
+    // Join two trees without an item in between (see join).
+    static node_ptr join_trees(const node_ptr &left, const node_ptr &right);
+
+    // Copy of the subtree of node with the item inserted (or its value
+    // replaced, then inserted is set to false).
+    node_ptr insert_node(const node_ptr &node, const kT &key, const vT &value, bool &inserted) const;
+
+    // Copy of the subtree of node without the key, or node itself if there
+    // is no such key (then erased is set to false).
+    node_ptr erase_node(const node_ptr &node, const kT &key, bool &erased) const;
+
+    // Build a perfectly balanced subtree of n items starting at first (see
+    // BaseTree::build_node).
+    static node_ptr build_node(const std::vector<std::pair<kT, vT>> &items, std::size_t first,
+        std::size_t n, std::size_t depth, std::size_t height);
+
+    // Make the tree with the root the latest version and publish it.
+    void publish(node_ptr root, std::size_t size);
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+    bool is_valid(const node_ptr &node) const;
+
+#endif
+
+public:
+
+    using key_type = kT;
+    using mapped_type = vT;
+
+    PersistentRBTree(const Compare &_comp = Compare());
+
+    // Construct a tree from the items (pairs of key and value) in
+    // [first, last), which must be sorted by keys without duplicates (e.g.
+    // the range of a BaseTree).
+    template <typename InputIt>
+    PersistentRBTree(InputIt first, InputIt last, const Compare &_comp = Compare());
+
+    // Versions are shared through snapshots.
+    PersistentRBTree(const PersistentRBTree<kT, vT, Compare> &) = delete;
+    PersistentRBTree<kT, vT, Compare> &operator=(const PersistentRBTree<kT, vT, Compare> &) = delete;
+
+    // Insert or replace a value at specified key.
+    // Returns true if a new node has been created and false otherwise.
+    bool insert(const kT &key, const vT &value);
+
+    // Delete the key if it is found.
+    // Returns true if the key existed in the tree.
+    bool erase(const kT &key);
+
+    // Remove all items (snapshots taken before keep them).
+    void clear();
+
+    // The latest published version of the tree. Thread-safe.
+    Snapshot snapshot() const;
+
+    // Reads of the latest version (see Snapshot). A ptr returned by lookup
+    // is only valid until the next write (which may free the old version);
+    // take a snapshot() to keep it for longer.
+    bool find(const kT &key, vT &dst) const { return this->latest.find(key, dst); }
+    const vT *lookup(const kT &key) const { return this->latest.lookup(key); }
+    bool contains(const kT &key) const { return this->latest.contains(key); }
+    std::size_t size() const { return this->latest.size(); }
+    std::size_t depth() const { return this->latest.depth(); }
+    tree_shape shape() const { return this->latest.shape(); }
+};
+
+static_assert(key_value_reader<PersistentRBTree<int, int>>);
+static_assert(key_value_reader<PersistentRBTree<int, int>::Snapshot>);
+
+
+// Snapshot
+
+template <typename kT, typename vT, class Compare>
+PersistentRBTree<kT, vT, Compare>::Snapshot::Snapshot(std::shared_ptr<const version> _state,
+    const Compare &_comp):
+    state(std::move(_state)),
+    comp(_comp)
+{}
+
+template <typename kT, typename vT, class Compare>
+PersistentRBTree<kT, vT, Compare>::Snapshot::Snapshot():
+    state(std::make_shared<const version>()),
+    comp()
+{}
+
+template <typename kT, typename vT, class Compare>
+template <typename K>
+const typename PersistentRBTree<kT, vT, Compare>::Node *PersistentRBTree<kT, vT, Compare>::Snapshot::search_by_key(
+    const K &key) const
+{
+    const Node *node = this->state->root.get();
+    while (node != nullptr)
+    {
+        auto order = key_order(this->comp, key, node->key);
+        if (order == 0)
+        {
+            return node;
+        }
+        node = (order < 0 ? node->left : node->right).get();
+    }
+    return nullptr;
+}
+
+template <typename kT, typename vT, class Compare>
+bool PersistentRBTree<kT, vT, Compare>::Snapshot::find(const kT &key, vT &dst) const
+{
+    const Node *node = this->search_by_key(key);
+    if (node == nullptr)
+    {
+        return false;
+    }
+    dst = node->value;
+    return true;
+}
+
+template <typename kT, typename vT, class Compare>
+const vT *PersistentRBTree<kT, vT, Compare>::Snapshot::lookup(const kT &key) const
+{
+    const Node *node = this->search_by_key(key);
+    return node == nullptr ? nullptr : &node->value;
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename F>
+bool PersistentRBTree<kT, vT, Compare>::Snapshot::find_and(const kT &key, F &&fn) const
+{
+    const Node *node = this->search_by_key(key);
+    if (node == nullptr)
+    {
+        return false;
+    }
+    fn(node->value);
+    return true;
+}
+
+template <typename kT, typename vT, class Compare>
+bool PersistentRBTree<kT, vT, Compare>::Snapshot::contains(const kT &key) const
+{
+    return this->search_by_key(key) != nullptr;
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename K> requires lookup_key<Compare, K, kT>
+const vT *PersistentRBTree<kT, vT, Compare>::Snapshot::lookup(const K &key) const
+{
+    const Node *node = this->search_by_key(key);
+    return node == nullptr ? nullptr : &node->value;
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename K> requires lookup_key<Compare, K, kT>
+bool PersistentRBTree<kT, vT, Compare>::Snapshot::contains(const K &key) const
+{
+    return this->search_by_key(key) != nullptr;
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename F>
+void PersistentRBTree<kT, vT, Compare>::Snapshot::for_each(F &&fn) const
+{
+    // the stack holds the Nodes whose left subtrees are being visited
+    std::vector<const Node*> stack;
+    const Node *node = this->state->root.get();
+    while (node != nullptr || !stack.empty())
+    {
+        if (node != nullptr)
+        {
+            stack.push_back(node);
+            node = node->left.get();
+            continue;
+        }
+        node = stack.back();
+        stack.pop_back();
+        fn(node->key, node->value);
+        node = node->right.get();
+    }
+}
+
+template <typename kT, typename vT, class Compare>
+std::size_t PersistentRBTree<kT, vT, Compare>::Snapshot::size() const
+{
+    return this->state->size;
+}
+
+template <typename kT, typename vT, class Compare>
+std::size_t PersistentRBTree<kT, vT, Compare>::Snapshot::depth() const
+{
+    return this->shape().height;
+}
+
+template <typename kT, typename vT, class Compare>
+tree_shape PersistentRBTree<kT, vT, Compare>::Snapshot::shape() const
+{
+    tree_shape result{};
+    std::vector<std::pair<const Node*, std::size_t>> stack;
+    if (this->state->root != nullptr)
+    {
+        stack.emplace_back(this->state->root.get(), 1);
+    }
+    while (!stack.empty())
+    {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+
+        result.size++;
+        result.total_path_length += depth;
+        if (result.histogram.size() < depth)
+        {
+            result.histogram.resize(depth);
+            result.height = depth;
+        }
+        result.histogram[depth - 1]++;
+
+        for (const Node *child : { node->left.get(), node->right.get() })
+        {
+            if (child != nullptr)
+            {
+                stack.emplace_back(child, depth + 1);
+            }
+        }
+    }
+    return result;
+}
+
+
+// Utils
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::make_node(bool red,
+    node_ptr left, const kT &key, const vT &value, node_ptr right)
+{
+    return std::make_shared<const Node>(std::move(left), key, value, std::move(right), red);
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::balance(bool red,
+    node_ptr left, const kT &key, const vT &value, node_ptr right)
+{
+    if (!red)
+    {
+        // in every case the middle one of the three Nodes becomes the red
+        // parent of the other two
+        if (is_red(left) && is_red(left->left))
+        {
+            LOGV("left-left");
+            const Node &l = *left, &ll = *left->left;
+            return make_node(true,
+                make_node(false, ll.left, ll.key, ll.value, ll.right),
+                l.key, l.value,
+                make_node(false, l.right, key, value, std::move(right)));
+        }
+        if (is_red(left) && is_red(left->right))
+        {
+            LOGV("left-right");
+            const Node &l = *left, &lr = *left->right;
+            return make_node(true,
+                make_node(false, l.left, l.key, l.value, lr.left),
+                lr.key, lr.value,
+                make_node(false, lr.right, key, value, std::move(right)));
+        }
+        if (is_red(right) && is_red(right->left))
+        {
+            LOGV("right-left");
+            const Node &r = *right, &rl = *right->left;
+            return make_node(true,
+                make_node(false, std::move(left), key, value, rl.left),
+                rl.key, rl.value,
+                make_node(false, rl.right, r.key, r.value, r.right));
+        }
+        if (is_red(right) && is_red(right->right))
+        {
+            LOGV("right-right");
+            const Node &r = *right, &rr = *right->right;
+            return make_node(true,
+                make_node(false, std::move(left), key, value, r.left),
+                r.key, r.value,
+                make_node(false, rr.left, rr.key, rr.value, rr.right));
+        }
+    }
+    return make_node(red, std::move(left), key, value, std::move(right));
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::blacken(const node_ptr &node)
+{
+    if (!is_red(node))
+    {
+        return node;
+    }
+    return make_node(false, node->left, node->key, node->value, node->right);
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::join_right(
+    const node_ptr &left, const kT &key, const vT &value, const node_ptr &right)
+{
+    // go down the right spine of left to the black subtree as high as right
+    // and put the item in its place as a red Node over both of them
+    if (!is_red(left) && black_height(left) == black_height(right))
+    {
+        return make_node(true, left, key, value, right);
+    }
+    return balance(left->red, left->left, left->key, left->value,
+        join_right(left->right, key, value, right));
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::join_left(
+    const node_ptr &left, const kT &key, const vT &value, const node_ptr &right)
+{
+    if (!is_red(right) && black_height(right) == black_height(left))
+    {
+        return make_node(true, left, key, value, right);
+    }
+    return balance(right->red, join_left(left, key, value, right->left),
+        right->key, right->value, right->right);
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::join(node_ptr left,
+    const kT &key, const vT &value, node_ptr right)
+{
+    // with black roots, the red Node put in between may only have a red
+    // parent, which balance fixes
+    left = blacken(left);
+    right = blacken(right);
+    if (black_height(left) > black_height(right))
+    {
+        return join_right(left, key, value, right);
+    }
+    if (black_height(left) < black_height(right))
+    {
+        return join_left(left, key, value, right);
+    }
+    return make_node(true, std::move(left), key, value, std::move(right));
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::split_last(
+    const node_ptr &node, const Node *&last)
+{
+    if (node->right == nullptr)
+    {
+        last = node.get();
+        return node->left;
+    }
+    node_ptr rest = split_last(node->right, last);
+    return join(node->left, node->key, node->value, std::move(rest));
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::join_trees(
+    const node_ptr &left, const node_ptr &right)
+{
+    if (left == nullptr)
+    {
+        return right;
+    }
+    // the removed Node is still a part of left (kept alive by the caller)
+    const Node *last;
+    node_ptr rest = split_last(left, last);
+    return join(std::move(rest), last->key, last->value, right);
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::insert_node(
+    const node_ptr &node, const kT &key, const vT &value, bool &inserted) const
+{
+    if (node == nullptr)
+    {
+        inserted = true;
+        return make_node(true, nullptr, key, value, nullptr);
+    }
+
+    auto order = key_order(this->comp, key, node->key);
+    if (order < 0)
+    {
+        return balance(node->red, this->insert_node(node->left, key, value, inserted),
+            node->key, node->value, node->right);
+    }
+    if (order > 0)
+    {
+        return balance(node->red, node->left,
+            node->key, node->value, this->insert_node(node->right, key, value, inserted));
+    }
+    inserted = false;
+    return make_node(node->red, node->left, node->key, value, node->right);
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::erase_node(
+    const node_ptr &node, const kT &key, bool &erased) const
+{
+    if (node == nullptr)
+    {
+        erased = false;
+        return nullptr;
+    }
+
+    auto order = key_order(this->comp, key, node->key);
+    if (order < 0)
+    {
+        node_ptr left = this->erase_node(node->left, key, erased);
+        return erased ? join(std::move(left), node->key, node->value, node->right) : node;
+    }
+    if (order > 0)
+    {
+        node_ptr right = this->erase_node(node->right, key, erased);
+        return erased ? join(node->left, node->key, node->value, std::move(right)) : node;
+    }
+    erased = true;
+    return join_trees(node->left, node->right);
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::node_ptr PersistentRBTree<kT, vT, Compare>::build_node(
+    const std::vector<std::pair<kT, vT>> &items, std::size_t first, std::size_t n,
+    std::size_t depth, std::size_t height)
+{
+    if (n == 0)
+    {
+        return nullptr;
+    }
+    std::size_t mid = n / 2;
+    node_ptr left = build_node(items, first, mid, depth + 1, height);
+    node_ptr right = build_node(items, first + mid + 1, n - mid - 1, depth + 1, height);
+
+    // only the deepest level may be incomplete, so if its Nodes are red all
+    // the paths have the same number of black ones
+    return make_node(depth == height && depth > 1, std::move(left),
+        items[first + mid].first, items[first + mid].second, std::move(right));
+}
+
+template <typename kT, typename vT, class Compare>
+void PersistentRBTree<kT, vT, Compare>::publish(node_ptr root, std::size_t size)
+{
+    auto state = std::make_shared<const version>(blacken(root), size);
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+    if (!this->is_valid(state->root))
+    {
+        LOG("!!! TREE IS INVALIDATED, TERMINATING !!!");
+        throw "Invalid tree";
+    }
+#endif
+
+    this->latest = Snapshot(state, this->comp);
+
+    // the old version is released after the mutex is unlocked (it may free
+    // a lot of Nodes)
+    std::unique_lock<std::mutex> lock(this->published_mutex);
+    this->published.swap(state);
+    lock.unlock();
+}
+
+#if defined _TREE_DEBUG && _TREE_DEBUG > 0
+
+template <typename kT, typename vT, class Compare>
+bool PersistentRBTree<kT, vT, Compare>::is_valid(const node_ptr &node) const
+{
+    if (node == nullptr)
+    {
+        return true;
+    }
+
+    if (node->red && (is_red(node->left) || is_red(node->right)))
+    {
+        LOGV("invalid persistent rbtree: red node has red children");
+        return false;
+    }
+
+    if (black_height(node->left) != black_height(node->right) ||
+        node->black_height != black_height(node->left) + !node->red)
+    {
+        LOGV("invalid persistent rbtree: black height mismatch");
+        return false;
+    }
+
+    if (node->left != nullptr && !key_less(this->comp, node->left->key, node->key) ||
+        node->right != nullptr && !key_less(this->comp, node->key, node->right->key))
+    {
+        LOGV("invalid persistent rbtree: wrong order of keys");
+        return false;
+    }
+
+    return this->is_valid(node->left) && this->is_valid(node->right);
+}
+
+#endif
+
+
+// Constructors
+
+template <typename kT, typename vT, class Compare>
+PersistentRBTree<kT, vT, Compare>::PersistentRBTree(const Compare &_comp):
+    comp(_comp),
+    latest(std::make_shared<const version>(), _comp),
+    published(this->latest.state)
+{
+    LOG("Tree constructed (persistent).");
+}
+
+template <typename kT, typename vT, class Compare>
+template <typename InputIt>
+PersistentRBTree<kT, vT, Compare>::PersistentRBTree(InputIt first, InputIt last, const Compare &_comp):
+    PersistentRBTree(_comp)
+{
+    std::vector<std::pair<kT, vT>> items;
+    for (; first != last; ++first)
+    {
+        auto &&item = *first;
+        items.emplace_back(item.first, item.second);
+    }
+    this->publish(build_node(items, 0, items.size(), 1, std::bit_width(items.size())), items.size());
+}
+
+
+// Interface
+
+template <typename kT, typename vT, class Compare>
+bool PersistentRBTree<kT, vT, Compare>::insert(const kT &key, const vT &value)
+{
+    bool inserted;
+    node_ptr root = this->insert_node(this->latest.state->root, key, value, inserted);
+    this->publish(std::move(root), this->latest.size() + inserted);
+    return inserted;
+}
+
+template <typename kT, typename vT, class Compare>
+bool PersistentRBTree<kT, vT, Compare>::erase(const kT &key)
+{
+    bool erased;
+    node_ptr root = this->erase_node(this->latest.state->root, key, erased);
+    if (erased)
+    {
+        this->publish(std::move(root), this->latest.size() - 1);
+    }
+    return erased;
+}
+
+template <typename kT, typename vT, class Compare>
+void PersistentRBTree<kT, vT, Compare>::clear()
+{
+    this->publish(nullptr, 0);
+}
+
+template <typename kT, typename vT, class Compare>
+typename PersistentRBTree<kT, vT, Compare>::Snapshot PersistentRBTree<kT, vT, Compare>::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(this->published_mutex);
+    return Snapshot(this->published, this->comp);
+}
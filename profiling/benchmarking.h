@@ -9,6 +9,7 @@
 
 
 #include "../target_interface.h"
+#include <algorithm>
 #include <chrono>
 #include <ctime>
 #include <functional>
@@ -16,11 +17,14 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <vector>
 
 #ifdef _WIN32
 
     #include <profileapi.h>
 
+    #define TIMER_NAME "QueryPerformanceCounter"
+
     // $timeit is a macro for timing certain operations / groups of operations
     // first argument is the name for a long long variable that will be
     // populated with timer value (in nanosecs); second argument is a block
@@ -37,21 +41,124 @@
         stuff                                                   \
         if (!QueryPerformanceCounter(&__end))                   \
         { throw "Fatal error: unable to get system time."; }    \
-        timer_name = __end.QuadPart - __start.QuadPart;         \
-        timer_name *= 1000000;                                  \
         if (!QueryPerformanceFrequency(&__freq))                \
         { throw "Fatal error: unable to get system time."; }    \
-        timer_name /= __freq.QuadPart;                          \
+        /* whole seconds and the rest are scaled separately, */ \
+        /* so that ticks * 10^9 does not overflow */            \
+        timer_name = __end.QuadPart - __start.QuadPart;         \
+        timer_name =                                            \
+            timer_name / __freq.QuadPart * 1000000000 +         \
+            timer_name % __freq.QuadPart * 1000000000 /         \
+            __freq.QuadPart;                                    \
     }
     
 #else
 
-    // TODO: add system api clock for *nix
-    #define $timeit(timer_name, stuff) throw "Not implemented!";
+    #include <time.h>
+
+    // Nanosecs from clock_gettime with CLOCK_MONOTONIC_RAW, which (unlike
+    // CLOCK_MONOTONIC) is not slewed by NTP.
+    inline long long monotonic_ns()
+    {
+        timespec ts;
+        if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0)
+        {
+            throw "Fatal error: unable to get system time.";
+        }
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    #if defined _PROFILE_TSC && (defined __x86_64__ || defined __i386__)
+
+        #include <x86intrin.h>
+
+        #define TIMER_NAME "TSC (rdtsc)"
+
+        // Reading the time stamp counter is several times cheaper than a
+        // call to clock_gettime, which matters for timing single inserts.
+        // The counter is assumed to be invariant (constant rate), which is
+        // the case for any x86 CPU of the last decade.
+        inline long long timer_now()
+        {
+            _mm_lfence();
+            long long ticks = __rdtsc();
+            _mm_lfence();
+            return ticks;
+        }
+
+        // Number of nanosecs per TSC tick, measured against the monotonic
+        // clock once (takes ~50 ms on the first call).
+        inline double tsc_ns_per_tick()
+        {
+            static const double ns_per_tick = []()
+            {
+                long long start_ns = monotonic_ns(), start_ticks = timer_now();
+                while (monotonic_ns() - start_ns < 50000000);
+                long long end_ns = monotonic_ns(), end_ticks = timer_now();
+                return double(end_ns - start_ns) / double(end_ticks - start_ticks);
+            }();
+            return ns_per_tick;
+        }
+
+        inline long long timer_to_ns(long long ticks)
+        {
+            return static_cast<long long>(ticks * tsc_ns_per_tick());
+        }
+
+    #else
+
+        #define TIMER_NAME "clock_gettime(CLOCK_MONOTONIC_RAW)"
+
+        inline long long timer_now() { return monotonic_ns(); }
+
+        inline long long timer_to_ns(long long ns) { return ns; }
+
+    #endif
+
+    // see the description of $timeit above (the only local variables
+    // declared here are __start and __end)
+    #define $timeit(timer_name, stuff)                          \
+    long long timer_name;                                       \
+    {                                                           \
+        long long __start = timer_now();                        \
+        stuff                                                   \
+        long long __end = timer_now();                          \
+        timer_name = timer_to_ns(__end - __start);              \
+    }
 
 #endif
 
 
+// Result of timing an empty block of code with $timeit.
+struct timer_overhead
+{
+    long long min;
+    long long median;
+};
+
+// Measure the overhead of $timeit itself (in nanosecs) by timing an empty
+// block n_samples times. This is the minimal duration that can be
+// distinguished from noise, so it should be taken into account when looking
+// at per-operation timings.
+inline timer_overhead measure_timer_overhead(const std::size_t n_samples = 100000)
+{
+    std::vector<long long> samples;
+    samples.reserve(n_samples);
+    for (std::size_t i = 0; i < n_samples; i++)
+    {
+        $timeit(timer, )
+        samples.push_back(timer);
+    }
+
+    auto middle = samples.begin() + samples.size() / 2;
+    std::nth_element(samples.begin(), middle, samples.end());
+    return timer_overhead{
+        *std::min_element(samples.begin(), samples.end()),
+        *middle
+    };
+}
+
+
 // Conveniece struct holding a pointer to KeyValueTree instance and a name
 // of the subject
 struct test_subject
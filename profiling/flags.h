@@ -7,6 +7,7 @@
 #include <sstream>
 #include <regex>
 #include <cmath>
+#include <cstring>
 
 unsigned int atoi(const std::string &s)
 {
@@ -1,6 +1,8 @@
 #include "../simple_tree.h"
 #include "../rb_tree.h"
 #include "../avltree.h"
+#include "../compact_rb_tree.h"
+#include "../btree.h"
 
 #include "benchmarking.h"
 #include "flags.h"
@@ -13,8 +15,16 @@
 #include <algorithm>
 #include <random>
 #include <chrono>
+#include <cstring>
+#include <span>
+#include <type_traits>
 
-std::vector<long long> test_fill_tree(KeyValueTree<int, int> *tree, const std::vector<int> &input, const bool test_depth)
+// Test functions are templates over the type of the tree: for
+// KeyValueTree<int, int> every operation is a virtual call, for a concrete
+// tree type calls are dispatched statically (and may be inlined).
+
+template <class Tree>
+std::vector<long long> test_fill_tree(Tree *tree, const std::vector<int> &input, const bool test_depth)
 {
     tree->clear();
     std::vector<long long> result;
@@ -39,6 +49,376 @@ std::vector<long long> test_fill_tree(KeyValueTree<int, int> *tree, const std::v
     return result;
 }
 
+// Fill the tree with input and time the lookup of every key from queries.
+template <class Tree>
+std::vector<long long> test_lookup(Tree *tree, const std::vector<int> &input,
+    const std::vector<int> &queries)
+{
+    tree->clear();
+    for (auto number : input)
+    {
+        tree->insert(number, 0);
+    }
+
+    // results of the lookups are used, so that statically dispatched (and
+    // inlined) calls are not optimized away
+    std::size_t found = 0;
+    std::vector<long long> result;
+    result.reserve(queries.size());
+    for (auto number : queries)
+    {
+        $timeit(timer,
+        found += tree->contains(number);
+        )
+        result.push_back(timer);
+    }
+
+    if (found != queries.size())
+    {
+        std::cout << "Warning: " << queries.size() - found << " keys were not found." << std::endl;
+    }
+    return result;
+}
+
+// Fill the tree and time the rank (see BaseTree::rank) of every key from
+// queries.
+template <class Tree>
+std::vector<long long> test_rank(Tree *tree, const std::vector<int> &input,
+    const std::vector<int> &queries)
+{
+    tree->clear();
+    for (auto number : input)
+    {
+        tree->insert(number, 0);
+    }
+
+    std::size_t total = 0;
+    std::vector<long long> result;
+    result.reserve(queries.size());
+    for (auto number : queries)
+    {
+        $timeit(timer,
+        total += tree->rank(number);
+        )
+        result.push_back(timer);
+    }
+
+    // every key is present, so the ranks are 0, ..., n - 1 in some order
+    if (total != queries.size() * (queries.size() - 1) / 2)
+    {
+        std::cout << "Warning: wrong ranks." << std::endl;
+    }
+    return result;
+}
+
+// Fill the tree (the value of every key is the key) and time the aggregate
+// (see BaseTree::aggregate) of the range of width keys starting with every
+// key from queries.
+template <class Tree>
+std::vector<long long> test_aggregate(Tree *tree, const std::vector<int> &input,
+    const std::vector<int> &queries, const int width)
+{
+    tree->clear();
+    for (auto number : input)
+    {
+        tree->insert(number, number);
+    }
+
+    long long total = 0;
+    std::vector<long long> result;
+    result.reserve(queries.size());
+    for (auto number : queries)
+    {
+        $timeit(timer,
+        total += tree->aggregate(number, number + width - 1);
+        )
+        result.push_back(timer);
+    }
+
+    if (total == 0)
+    {
+        std::cout << "Warning: all the aggregates are empty." << std::endl;
+    }
+    return result;
+}
+
+// Fill the tree, freeze it (see FrozenTree) and time the lookup of every key
+// from queries in the snapshot.
+template <class Tree>
+std::vector<long long> test_lookup_frozen(Tree *tree, const std::vector<int> &input,
+    const std::vector<int> &queries)
+{
+    tree->clear();
+    for (auto number : input)
+    {
+        tree->insert(number, 0);
+    }
+    auto frozen = tree->freeze();
+
+    std::size_t found = 0;
+    std::vector<long long> result;
+    result.reserve(queries.size());
+    for (auto number : queries)
+    {
+        $timeit(timer,
+        found += frozen.contains(number);
+        )
+        result.push_back(timer);
+    }
+
+    if (found != queries.size())
+    {
+        std::cout << "Warning: " << queries.size() - found << " keys were not found." << std::endl;
+    }
+    return result;
+}
+
+// Fill the tree and time the lookup of the keys from queries,
+// batch_size keys at a time (every key of a batch gets the average time of
+// the batch); lookup_batch(tree, keys, out) must lookup the keys (like
+// find_batch) and return the number of keys found.
+template <class Tree, typename LookupBatch>
+std::vector<long long> test_lookup_batch(Tree *tree, const std::vector<int> &input,
+    const std::vector<int> &queries, const std::size_t batch_size, LookupBatch lookup_batch)
+{
+    tree->clear();
+    for (auto number : input)
+    {
+        tree->insert(number, 0);
+    }
+
+    std::size_t found = 0;
+    std::vector<const int*> out(batch_size);
+    std::vector<long long> result;
+    result.reserve(queries.size());
+    for (std::size_t first = 0; first < queries.size(); first += batch_size)
+    {
+        std::size_t n = std::min(batch_size, queries.size() - first);
+        std::span<const int> batch(queries.data() + first, n);
+        $timeit(timer,
+        found += lookup_batch(tree, batch, out);
+        )
+        result.insert(result.end(), n, timer / static_cast<long long>(n));
+    }
+
+    if (found != queries.size())
+    {
+        std::cout << "Warning: " << queries.size() - found << " keys were not found." << std::endl;
+    }
+    return result;
+}
+
+// Fill the tree and get the number of nodes at every depth (index of the
+// result is the depth, starting with 1).
+template <class Tree>
+std::vector<long long> test_shape(Tree *tree, const std::vector<int> &input)
+{
+    tree->clear();
+    for (auto number : input)
+    {
+        tree->insert(number, 0);
+    }
+
+    tree_shape shape = tree->shape();
+    std::cout << "Height: " << shape.height << ", average path length: "
+        << shape.average_path_length() << "." << std::endl;
+    return std::vector<long long>(shape.histogram.begin(), shape.histogram.end());
+}
+
+
+// Get the tree that test functions should be run on: either the interface
+// itself or the concrete tree behind it.
+template <class Tree>
+Tree *unwrap(KeyValueTree<int, int> *tree)
+{
+    if constexpr (std::is_same_v<Tree, KeyValueTree<int, int>>)
+    {
+        return tree;
+    }
+    else
+    {
+        return &static_cast<VirtualTree<Tree>*>(tree)->get();
+    }
+}
+
+// Test cases that run test functions for Interface (see above): either
+// KeyValueTree<int, int> or the concrete Tree. Trees that support batched
+// lookups, order statistics or aggregates or can be frozen get extra cases
+// (after all the common ones); those operations are not in the KeyValueTree,
+// so the extra cases always call Tree directly. If depth() of the tree is
+// only an upper bound of its height (exact_depth is false), the depth cases
+// are named "depth_bound" instead of "depth".
+template <class Interface, class Tree>
+std::vector<test_case> make_cases(const std::vector<int> &sorted, const std::vector<int> &unsorted,
+    const std::string &output, const unsigned int n_iters, const bool exact_depth)
+{
+    const std::string depth = exact_depth ? "depth" : "depth_bound";
+
+    std::vector<test_case> cases
+    {
+        {
+            "insertion",
+            [&unsorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_fill_tree(unwrap<Interface>(tree), unsorted, false); },
+            output,
+            n_iters
+        },
+        {
+            "insertion_sorted",
+            [&sorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_fill_tree(unwrap<Interface>(tree), sorted, false); },
+            output,
+            n_iters
+        },
+        {
+            "lookup",
+            [&unsorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_lookup(unwrap<Interface>(tree), unsorted, unsorted); },
+            output,
+            n_iters
+        },
+        {
+            depth,
+            [&unsorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_fill_tree(unwrap<Interface>(tree), unsorted, true); },
+            output
+        },
+        {
+            depth + "_sorted",
+            [&sorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_fill_tree(unwrap<Interface>(tree), sorted, true); },
+            output
+        },
+        {
+            "depth_histogram",
+            [&unsorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_shape(unwrap<Interface>(tree), unsorted); },
+            output
+        },
+        {
+            "depth_histogram_sorted",
+            [&sorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_shape(unwrap<Interface>(tree), sorted); },
+            output
+        },
+    };
+
+    if constexpr (requires (const Tree &tree, std::span<const int> keys, std::span<const int*> out)
+        { tree.find_batch(keys, out); })
+    {
+        cases.push_back({
+            "lookup_batch",
+            [&unsorted](KeyValueTree<int, int>* const tree) -> std::vector<long long>
+            {
+                return test_lookup_batch(unwrap<Tree>(tree), unsorted, unsorted, 64,
+                    [](Tree *tree, std::span<const int> keys, std::vector<const int*> &out)
+                    { return tree->find_batch(keys, out); });
+            },
+            output,
+            n_iters
+        });
+    }
+    if constexpr (requires (const Tree &tree, std::span<const int> keys, std::span<const int*> out)
+        { tree.find_sorted_batch(keys, out); })
+    {
+        cases.push_back({
+            "lookup_sorted_batch",
+            [&sorted, &unsorted](KeyValueTree<int, int>* const tree) -> std::vector<long long>
+            {
+                return test_lookup_batch(unwrap<Tree>(tree), unsorted, sorted, 64,
+                    [](Tree *tree, std::span<const int> keys, std::vector<const int*> &out)
+                    { return tree->find_sorted_batch(keys, out); });
+            },
+            output,
+            n_iters
+        });
+    }
+    if constexpr (requires (const Tree &tree) { tree.lookup_coro(0); })
+    {
+        cases.push_back({
+            "lookup_coro",
+            [&unsorted](KeyValueTree<int, int>* const tree) -> std::vector<long long>
+            {
+                return test_lookup_batch(unwrap<Tree>(tree), unsorted, unsorted, 64,
+                    [](Tree *tree, std::span<const int> keys, std::vector<const int*> &out)
+                    {
+                        interleave([tree](const int &key) { return tree->lookup_coro(key); }, keys, out);
+                        return std::size_t(std::count_if(out.begin(), out.begin() + keys.size(),
+                            [](const int *value) { return value != nullptr; }));
+                    });
+            },
+            output,
+            n_iters
+        });
+    }
+    if constexpr (requires (const Tree &tree) { tree.rank(0); })
+    {
+        cases.push_back({
+            "rank",
+            [&unsorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_rank(unwrap<Tree>(tree), unsorted, unsorted); },
+            output,
+            n_iters
+        });
+    }
+    if constexpr (requires (const Tree &tree) { tree.aggregate(0, 0); })
+    {
+        cases.push_back({
+            "aggregate",
+            [&unsorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_aggregate(unwrap<Tree>(tree), unsorted, unsorted, 1000); },
+            output,
+            n_iters
+        });
+    }
+    if constexpr (requires (const Tree &tree) { tree.freeze(); })
+    {
+        cases.push_back({
+            "lookup_frozen",
+            [&unsorted](KeyValueTree<int, int>* const tree)
+            -> std::vector<long long> { return test_lookup_frozen(unwrap<Tree>(tree), unsorted, unsorted); },
+            output,
+            n_iters
+        });
+    }
+    return cases;
+}
+
+// Test subject together with the test cases prepared for its type.
+struct profiled_subject
+{
+    test_subject subject;
+    std::vector<test_case> cases;
+};
+
+// Add a subject of type Tree for every requested kind of dispatch ("virtual",
+// "static" or "both"); names of statically dispatched subjects get the
+// "-static" suffix if both kinds are requested. The extra cases of the tree
+// (see make_cases) are run once: by the static subject if there is one.
+template <class Tree>
+void add_subject(std::vector<profiled_subject> &subjects, const std::string &name,
+    const std::string &dispatch, const std::vector<int> &sorted,
+    const std::vector<int> &unsorted, const std::string &output, const unsigned int n_iters,
+    const bool exact_depth = true)
+{
+    if (dispatch == "virtual" || dispatch == "both")
+    {
+        subjects.push_back({
+            test_subject(name, new VirtualTree<Tree>),
+            dispatch == "both" ?
+                make_cases<KeyValueTree<int, int>, KeyValueTree<int, int>>(sorted, unsorted, output, n_iters, exact_depth) :
+                make_cases<KeyValueTree<int, int>, Tree>(sorted, unsorted, output, n_iters, exact_depth)
+        });
+    }
+    if (dispatch == "static" || dispatch == "both")
+    {
+        subjects.push_back({
+            test_subject(dispatch == "both" ? name + "-static" : name, new VirtualTree<Tree>),
+            make_cases<Tree, Tree>(sorted, unsorted, output, n_iters, exact_depth)
+        });
+    }
+}
+
 
 int main(int argc, const char * argv[])
 {
@@ -47,7 +427,8 @@ int main(int argc, const char * argv[])
         std::cout << "Profiler accepts following parameters (use --{name}={value} syntax):" << std::endl
             << "\t--size - the size of input arrays, default=10000" << std::endl
             << "\t--iters - number of repetitions over which time measurements are averaged, default=50" << std::endl
-            << "\t--output - output directory (this directory must exist in \".\" exist before profiler is run)" << std::endl;
+            << "\t--output - output directory (this directory must exist in \".\" exist before profiler is run)" << std::endl
+            << "\t--dispatch - how tree methods are called: virtual (through KeyValueTree), static or both, default=virtual" << std::endl;
         return 0;
     }
 
@@ -57,13 +438,13 @@ int main(int argc, const char * argv[])
     unsigned int N_ITERS = parse_flag(argc, argv, "iters", 50);
     // output directory
     std::string OUTPUT = parse_flag(argc, argv, "output", "results");
-
-    std::vector<test_subject> subjects
+    // kind of dispatch of the calls to the trees
+    std::string DISPATCH = parse_flag(argc, argv, "dispatch", "virtual");
+    if (DISPATCH != "virtual" && DISPATCH != "static" && DISPATCH != "both")
     {
-        {"simple", new SimpleTree<int, int>},
-        {"red-black", new RBTree<int, int>},
-        {"avl", new AVLTree<int, int>}
-    };
+        std::cout << "Unknown dispatch: " << DISPATCH << std::endl;
+        return 1;
+    }
 
     // sorted input array
     std::vector<int> sorted;
@@ -80,51 +461,49 @@ int main(int argc, const char * argv[])
     std::shuffle(unsorted.begin(), unsorted.end(),
         std::default_random_engine(1234));
 
-    std::vector<test_case> cases
+    std::vector<profiled_subject> subjects;
+    add_subject<SimpleTree<int, int>>(subjects, "simple", DISPATCH, sorted, unsorted, OUTPUT, N_ITERS);
+    add_subject<RBTree<int, int>>(subjects, "red-black", DISPATCH, sorted, unsorted, OUTPUT, N_ITERS);
+    add_subject<AVLTree<int, int>>(subjects, "avl", DISPATCH, sorted, unsorted, OUTPUT, N_ITERS);
+    add_subject<RBTree<int, int, default_compare, subtree_size>>(subjects, "red-black-sized",
+        DISPATCH, sorted, unsorted, OUTPUT, N_ITERS);
+    add_subject<RBTree<int, int, default_compare, aggregate<value_sum<long long>>>>(subjects,
+        "red-black-sum", DISPATCH, sorted, unsorted, OUTPUT, N_ITERS);
+    // depth of the compact tree is an upper bound (twice its black height)
+    add_subject<CompactRBTree<int, int>>(subjects, "red-black-compact", DISPATCH, sorted, unsorted, OUTPUT, N_ITERS,
+        false);
+    add_subject<BTree<int, int>>(subjects, "b-tree", DISPATCH, sorted, unsorted, OUTPUT, N_ITERS);
+    std::size_t n_cases = 0;
+    for (auto &sub : subjects)
     {
-        {
-            "insertion",
-            [unsorted](KeyValueTree<int, int>* const tree)
-            -> std::vector<long long> { return test_fill_tree(tree, unsorted, false); },
-            OUTPUT,
-            N_ITERS
-        },
-        {
-            "insertion_sorted",
-            [sorted](KeyValueTree<int, int>* const tree)
-            -> std::vector<long long> { return test_fill_tree(tree, sorted, false); },
-            OUTPUT,
-            N_ITERS
-        },
-        {
-            "depth",
-            [unsorted](KeyValueTree<int, int>* const tree)
-            -> std::vector<long long> { return test_fill_tree(tree, unsorted, true); },
-            OUTPUT
-        },
-        {
-            "depth_sorted",
-            [sorted](KeyValueTree<int, int>* const tree)
-            -> std::vector<long long> { return test_fill_tree(tree, sorted, true); },
-            OUTPUT
-        },
-    };
+        n_cases = std::max(n_cases, sub.cases.size());
+    }
 
     std::cout << "Starting profiling. Number of test subjects: " << subjects.size()
-        << ", number of test cases: " << cases.size() << "." << std::endl
+        << ", number of test cases: " << n_cases << "." << std::endl
         << "Using following parameters: " << std::endl
         << "\t- iters=" << N_ITERS << std::endl
         << "\t- size=" << N_ITEMS << std::endl
+        << "\t- dispatch=" << DISPATCH << std::endl
         << "Output will be written to ./" << OUTPUT << "/" << std::endl
         << std::endl << "Go take a coffee." << std::endl << std::endl;
 
+    timer_overhead overhead = measure_timer_overhead();
+    std::cout << "Timer: " << TIMER_NAME << ", overhead of a single measurement: "
+        << overhead.median << " ns (median), " << overhead.min << " ns (min)."
+        << std::endl
+        << "Search in b-tree nodes: " << SIMD_SEARCH_NAME << " kernels." << std::endl << std::endl;
+
     auto start_time = std::chrono::steady_clock::now();
 
-    for (auto &tc : cases)
+    for (std::size_t i = 0; i < n_cases; i++)
     {
         for (auto &sub : subjects)
         {
-            tc.perform(sub);
+            if (i < sub.cases.size())
+            {
+                sub.cases[i].perform(sub.subject);
+            }
         }
     }
 
@@ -137,6 +516,6 @@ int main(int argc, const char * argv[])
 
     for (auto &sub : subjects)
     {
-        delete sub.tree;
+        delete sub.subject.tree;
     }
 }
\ No newline at end of file
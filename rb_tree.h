@@ -2,18 +2,22 @@
 
 #include "base.h"
 
-template <typename kT, typename vT>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+
+template <typename kT, typename vT, class Augment = no_augment>
 struct RBNode
 {
     kT key;
     vT value;
 
-    RBNode<kT, vT> *parent;
+    RBNode<kT, vT, Augment> *parent;
 
-    RBNode<kT, vT> *left;
-    RBNode<kT, vT> *right;
+    RBNode<kT, vT, Augment> *left;
+    RBNode<kT, vT, Augment> *right;
 
-    enum Color
+    enum Color : std::uint8_t
     {
         RED,
         BLACK
@@ -21,35 +25,52 @@ struct RBNode
 
     Color color;
 
-    RBNode(const std::pair<kT, vT> &item, RBNode *_parent):
-        key(item.first),
-        value(item.second),
+    // number of black nodes on the path from this to the leftmost leaf of
+    // the subtree (see update); it has to be updated after the color changes
+    std::uint8_t black_height;
+
+    // height of the subtree (see update)
+    std::uint32_t height;
+
+    // data about the subtree (see "augment.h"), maintained by update
+    [[no_unique_address]] Augment augment;
+
+    template <typename K, typename... Args>
+    RBNode(RBNode *_parent, K &&_key, Args&&... args):
+        key(std::forward<K>(_key)),
+        value(std::forward<Args>(args)...),
         parent(_parent),
         left(nullptr),
         right(nullptr),
-        color(RED)
+        color(RED),
+        black_height(0),
+        height(1),
+        augment()
     {}
 
-    RBNode(const RBNode<kT, vT> &other):
+    RBNode(const RBNode<kT, vT, Augment> &other):
         key(other.key),
         value(other.value),
         parent(nullptr),
         left(nullptr),
         right(nullptr),
-        color(other.color)
+        color(other.color),
+        black_height(other.black_height),
+        height(other.height),
+        augment(other.augment)
     {}
 
     RBNode() = delete;
-    RBNode(RBNode<kT, vT> &&) = delete;
+    RBNode(RBNode<kT, vT, Augment> &&) = delete;
 
     // utils for tree navigation
 
-    RBNode<kT, vT> *grandparent() const
+    RBNode<kT, vT, Augment> *grandparent() const
     {
         return this->parent == nullptr ? nullptr : this->parent->parent;
     }
 
-    RBNode<kT, vT> *sibling() const
+    RBNode<kT, vT, Augment> *sibling() const
     {
         if (this->parent == nullptr)
         {
@@ -58,15 +79,25 @@ struct RBNode
         return this->parent->left == this ? this->parent->right : this->parent->left;
     }
 
-    RBNode<kT, vT> *uncle() const
+    RBNode<kT, vT, Augment> *uncle() const
     {
         return this->parent == nullptr ? nullptr : this->parent->sibling();
     }
 
+    void update()
+    {
+        std::uint32_t left_h = this->left == nullptr ? 0 : this->left->height;
+        std::uint32_t right_h = this->right == nullptr ? 0 : this->right->height;
+        this->height = 1 + (left_h > right_h ? left_h : right_h);
+        this->black_height = (this->left == nullptr ? 0 : this->left->black_height) +
+            (this->color == BLACK);
+        this->augment.update(*this);
+    }
+
     void rotate_left()
     {
         LOGV("->");
-        RBNode<kT, vT> *pivot = this->right;
+        RBNode<kT, vT, Augment> *pivot = this->right;
 
         if (pivot == nullptr)
         {
@@ -96,13 +127,16 @@ struct RBNode
 
         this->parent = pivot;
         pivot->left= this;
+
+        this->update();
+        pivot->update();
         LOGV("<-");
     }
 
     void rotate_right()
     {
         LOGV("->");
-        RBNode<kT, vT> *pivot = this->left;
+        RBNode<kT, vT, Augment> *pivot = this->left;
 
         pivot->parent = this->parent;
         if (this->parent != nullptr)
@@ -125,6 +159,9 @@ struct RBNode
 
         this->parent = pivot;
         pivot->right= this;
+
+        this->update();
+        pivot->update();
         LOGV("<-");
     }
 
@@ -147,6 +184,9 @@ struct RBNode
         {
             this->parent->color = BLACK;
             this->uncle()->color = BLACK;
+            // the uncle is not on the path that is updated after the
+            // insertion
+            this->uncle()->update();
             this->grandparent()->color = RED;
             this->grandparent()->adjust_insert();
             LOGV("Case 3 fired");
@@ -154,7 +194,7 @@ struct RBNode
         }
 
         // n is needed because last case might not be applied to this
-        RBNode<kT, vT> *n;
+        RBNode<kT, vT, Augment> *n;
 
         if (
             this->parent->right == this &&
@@ -196,16 +236,106 @@ struct RBNode
         }
     }
 
+    void adjust_build(std::size_t depth, std::size_t height)
+    {
+        // in a perfectly balanced tree only the last level may be incomplete;
+        // coloring it red (and all the other nodes black) gives the same
+        // black depth for every path
+        this->color = (depth == height && depth > 1) ? RED : BLACK;
+    }
+
+    // Join (detached) trees left and right and the node middle, whose key is
+    // between the keys of left and the keys of right, into one tree and
+    // return its root. The roots of left and right are made black (so they
+    // may be any subtrees of red-black trees). The middle node goes on the
+    // spine of the higher tree, in place of the subtree with the black height
+    // of the other one, so it takes O(difference of black heights) steps.
+    static RBNode<kT, vT, Augment> *join(RBNode<kT, vT, Augment> *left,
+        RBNode<kT, vT, Augment> *middle, RBNode<kT, vT, Augment> *right)
+    {
+        for (RBNode<kT, vT, Augment> *root : { left, right })
+        {
+            if (root != nullptr)
+            {
+                root->color = BLACK;
+                root->update();
+            }
+        }
+        std::size_t left_bh = left == nullptr ? 0 : left->black_height;
+        std::size_t right_bh = right == nullptr ? 0 : right->black_height;
+
+        middle->parent = nullptr;
+        if (left_bh == right_bh)
+        {
+            middle->color = BLACK;
+            middle->link(left, right);
+            return middle;
+        }
+
+        // the first black node of the same black height as the lower tree on
+        // the facing spine of the higher one
+        bool left_higher = left_bh > right_bh;
+        std::size_t height = left_higher ? left_bh : right_bh;
+        std::size_t target = left_higher ? right_bh : left_bh;
+        RBNode<kT, vT, Augment> *parent = nullptr;
+        RBNode<kT, vT, Augment> *node = left_higher ? left : right;
+        while (node != nullptr && (node->color == RED || height > target))
+        {
+            height -= node->color == BLACK;
+            parent = node;
+            node = left_higher ? node->right : node->left;
+        }
+
+        middle->color = RED;
+        middle->parent = parent;
+        if (left_higher)
+        {
+            parent->right = middle;
+            middle->link(node, right);
+        }
+        else
+        {
+            parent->left = middle;
+            middle->link(left, node);
+        }
+
+        // the same as after an insertion: the parent might be red too
+        middle->adjust_insert();
+        RBNode<kT, vT, Augment> *root = middle;
+        for (; root->parent != nullptr; root = root->parent)
+        {
+            root->update();
+        }
+        root->update();
+        return root;
+    }
+
+    // make left and right the children of this
+    void link(RBNode<kT, vT, Augment> *_left, RBNode<kT, vT, Augment> *_right)
+    {
+        this->left = _left;
+        this->right = _right;
+        if (_left != nullptr)
+        {
+            _left->parent = this;
+        }
+        if (_right != nullptr)
+        {
+            _right->parent = this;
+        }
+        this->update();
+    }
+
     // replace_with modifies all connections in the tree
     // involving this to involve replacement instead;
     // it does nothing to connections involving replacement,
     // so this method should be used carefully to prevent data loss/
     // memory leaks/appearance of cycles in the tree
-    void replace_with(RBNode<kT, vT> *replacement)
+    void replace_with(RBNode<kT, vT, Augment> *replacement)
     {
         if (replacement != nullptr)
         {
-            replacement->parent == this->parent;
+            replacement->parent = this->parent;
         }
 
         if (this->parent != nullptr)
@@ -266,6 +396,7 @@ struct RBNode
         {
             LOGV("Case 3 fired");
             s->color = RED;
+            s->update();
             this->parent->rb_adjust_delete();
             return;
         }
@@ -285,6 +416,7 @@ struct RBNode
         {
             LOGV("Case 4 fired");
             s->color = RED;
+            s->update();
             this->parent->color = BLACK;
             return;
         }
@@ -308,7 +440,7 @@ struct RBNode
             else if (
                 this == this->parent->right &&
                 (s->left == nullptr || s->left->color == BLACK) &&
-                (s->right != nullptr && s->right->color) == RED
+                (s->right != nullptr && s->right->color == RED)
             )
             {
                 s->color = RED;
@@ -328,11 +460,13 @@ struct RBNode
         if (this == this->parent->left)
         {
             s->right->color = BLACK;
+            s->right->update();
             this->parent->rotate_left();
         }
         else
         {
             s->left->color = BLACK;
+            s->left->update();
             this->parent->rotate_right();
         }
     }
@@ -344,7 +478,7 @@ struct RBNode
         {
             // if this has both children, we take rightmost node from left
             // subtree as replacement, adjust it and replace this with it
-            RBNode<kT, vT> *replacement;
+            RBNode<kT, vT, Augment> *replacement;
             for (
                 replacement = this->left;
                 replacement->right != nullptr;
@@ -353,6 +487,18 @@ struct RBNode
 
             replacement->adjust_delete();
 
+            // replacement takes the place (and the color) of this
+            replacement->color = this->color;
+            replacement->left = this->left;
+            replacement->right = this->right;
+            if (replacement->left != nullptr)
+            {
+                replacement->left->parent = replacement;
+            }
+            if (replacement->right != nullptr)
+            {
+                replacement->right->parent = replacement;
+            }
             this->replace_with(replacement);
             return;
         }
@@ -360,7 +506,7 @@ struct RBNode
         // now this has at most 1 non-null child
 
         // the only child:
-        RBNode<kT, vT> *child = this->left == nullptr ? this->right : this->left;
+        RBNode<kT, vT, Augment> *child = this->left == nullptr ? this->right : this->left;
 
         if (child == nullptr)
         {
@@ -378,7 +524,9 @@ struct RBNode
         {
             if (child->color == RED)
             {
+                // the path is updated from the parent of the child
                 child->color = BLACK;
+                child->update();
             }
             else
             {
@@ -417,6 +565,21 @@ struct RBNode
             return false;
         }
 
+        std::uint32_t left_h = this->left == nullptr ? 0 : this->left->height;
+        std::uint32_t right_h = this->right == nullptr ? 0 : this->right->height;
+        if (this->height != 1 + (left_h > right_h ? left_h : right_h))
+        {
+            LOGV("invalid rbtree: wrong cached height");
+            return false;
+        }
+
+        std::uint8_t left_bh = this->left == nullptr ? 0 : this->left->black_height;
+        if (this->black_height != left_bh + (this->color == BLACK))
+        {
+            LOGV("invalid rbtree: wrong cached black height");
+            return false;
+        }
+
         if (
             this->left != nullptr && !this->left->is_valid() ||
             this->right != nullptr && !this->right->is_valid()
@@ -457,5 +620,7 @@ struct RBNode
 
 };
 
-template <typename kT, typename vT>
-using RBTree = BaseTree<kT, vT, RBNode<kT, vT>>;
+template <typename kT, typename vT, class Compare = default_compare, class Augment = no_augment>
+using RBTree = BaseTree<kT, vT, RBNode<kT, vT, Augment>, Compare>;
+
+static_assert(key_value_tree<RBTree<int, int>>);
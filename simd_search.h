@@ -0,0 +1,154 @@
+#pragma once
+
+#include <bit>
+#include <compare>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+
+#include "key_compare.h"
+
+// Vectorized search in small sorted arrays of integer keys (e.g. the keys of
+// a BTree node, see "btree.h"). Instead of a binary search, the kernels
+// compare the key with all the keys of the array at once and count the
+// results, so the search has no data-dependent branches.
+//
+// The kernel is chosen at compile time from the instruction sets enabled for
+// the target (e.g. with -mavx2 or -march=native): AVX2, SSE4.2 or SSE2 (64-bit
+// keys need at least SSE4.2). Defining _TREE_NO_SIMD disables the kernels.
+
+#if !defined _TREE_NO_SIMD && (defined __AVX2__ || defined __SSE4_2__ || defined __SSE2__)
+
+    #include <immintrin.h>
+
+#endif
+
+#if defined _TREE_NO_SIMD
+
+    #define SIMD_SEARCH_NAME "none"
+    #define SIMD_SEARCH_32 0
+    #define SIMD_SEARCH_64 0
+
+#elif defined __AVX2__
+
+    #define SIMD_SEARCH_NAME "AVX2"
+    #define SIMD_SEARCH_32 1
+    #define SIMD_SEARCH_64 1
+
+#elif defined __SSE4_2__
+
+    #define SIMD_SEARCH_NAME "SSE4.2"
+    #define SIMD_SEARCH_32 1
+    #define SIMD_SEARCH_64 1
+
+#elif defined __SSE2__
+
+    #define SIMD_SEARCH_NAME "SSE2"
+    #define SIMD_SEARCH_32 1
+    #define SIMD_SEARCH_64 0
+
+#else
+
+    #define SIMD_SEARCH_NAME "none"
+    #define SIMD_SEARCH_32 0
+    #define SIMD_SEARCH_64 0
+
+#endif
+
+// Keys of type T ordered by Compare can be searched with the kernels: T is a
+// 32 or 64-bit integer (supported by the selected kernel) and Compare is one
+// of the standard comparators that order integers naturally.
+template <typename T, class Compare>
+constexpr bool simd_searchable =
+    std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+    ((sizeof(T) == 4 && SIMD_SEARCH_32) || (sizeof(T) == 8 && SIMD_SEARCH_64)) &&
+    (std::is_same_v<Compare, default_compare> || std::is_same_v<Compare, std::compare_three_way> ||
+        std::is_same_v<Compare, std::less<T>> || std::is_same_v<Compare, std::less<>>);
+
+// Number of the first n keys that are less than key (if Less) or greater
+// than key (otherwise).
+template <bool Less, typename T>
+std::size_t simd_count(const T *keys, std::size_t n, T key)
+{
+    std::size_t count = 0, i = 0;
+
+#if SIMD_SEARCH_32 || SIMD_SEARCH_64
+
+    // signed comparisons are used for unsigned keys with flipped top bits
+    constexpr T bias = std::is_signed_v<T> ? T(0) : T(T(1) << (sizeof(T) * 8 - 1));
+
+    if constexpr (sizeof(T) == 4)
+    {
+    #if defined __AVX2__
+        const __m256i b = _mm256_set1_epi32(int(bias));
+        const __m256i k = _mm256_xor_si256(_mm256_set1_epi32(int(key)), b);
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i v = _mm256_xor_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), b);
+            __m256i r = Less ? _mm256_cmpgt_epi32(k, v) : _mm256_cmpgt_epi32(v, k);
+            count += std::popcount(unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(r))));
+        }
+    #else
+        const __m128i b = _mm_set1_epi32(int(bias));
+        const __m128i k = _mm_xor_si128(_mm_set1_epi32(int(key)), b);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i v = _mm_xor_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), b);
+            __m128i r = Less ? _mm_cmpgt_epi32(k, v) : _mm_cmpgt_epi32(v, k);
+            count += std::popcount(unsigned(_mm_movemask_ps(_mm_castsi128_ps(r))));
+        }
+    #endif
+    }
+
+  #if SIMD_SEARCH_64
+    if constexpr (sizeof(T) == 8)
+    {
+    #if defined __AVX2__
+        const __m256i b = _mm256_set1_epi64x((long long)(bias));
+        const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((long long)(key)), b);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i v = _mm256_xor_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), b);
+            __m256i r = Less ? _mm256_cmpgt_epi64(k, v) : _mm256_cmpgt_epi64(v, k);
+            count += std::popcount(unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(r))));
+        }
+    #else
+        const __m128i b = _mm_set1_epi64x((long long)(bias));
+        const __m128i k = _mm_xor_si128(_mm_set1_epi64x((long long)(key)), b);
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128i v = _mm_xor_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), b);
+            __m128i r = Less ? _mm_cmpgt_epi64(k, v) : _mm_cmpgt_epi64(v, k);
+            count += std::popcount(unsigned(_mm_movemask_pd(_mm_castsi128_pd(r))));
+        }
+    #endif
+    }
+  #endif
+
+#endif
+
+    // the rest of the keys (or all of them if there are no kernels)
+    for (; i < n; i++)
+    {
+        count += Less ? keys[i] < key : keys[i] > key;
+    }
+    return count;
+}
+
+// Index of the first of n sorted keys that is not less than key.
+template <typename T>
+std::size_t simd_lower_index(const T *keys, std::size_t n, T key)
+{
+    return simd_count<true>(keys, n, key);
+}
+
+// Index of the first of n sorted keys that is greater than key.
+template <typename T>
+std::size_t simd_upper_index(const T *keys, std::size_t n, T key)
+{
+    return n - simd_count<false>(keys, n, key);
+}
@@ -2,37 +2,50 @@
 
 #include "base.h"
 
+#include <cstdint>
+
 // An implementation of the Node (required for the BaseTree) that does not
 // balance itself. Used for comparison and to practise implementing the Node.
-template <typename kT, typename vT>
+template <typename kT, typename vT, class Augment = no_augment>
 struct SimpleNode
 {
     kT key;
     vT value;
 
-    SimpleNode<kT, vT> *parent;
+    SimpleNode<kT, vT, Augment> *parent;
+
+    SimpleNode<kT, vT, Augment> *left;
+    SimpleNode<kT, vT, Augment> *right;
+
+    // height of the subtree (see update)
+    std::uint32_t height;
 
-    SimpleNode<kT, vT> *left;
-    SimpleNode<kT, vT> *right;
+    // data about the subtree (see "augment.h"), maintained by update
+    [[no_unique_address]] Augment augment;
 
-    SimpleNode(const std::pair<kT, vT> &item, SimpleNode *_parent):
-        key(item.first),
-        value(item.second),
+    template <typename K, typename... Args>
+    SimpleNode(SimpleNode *_parent, K &&_key, Args&&... args):
+        key(std::forward<K>(_key)),
+        value(std::forward<Args>(args)...),
         parent(_parent),
         left(nullptr),
-        right(nullptr)
+        right(nullptr),
+        height(1),
+        augment()
     {}
 
-    SimpleNode(const SimpleNode<kT, vT> &other):
+    SimpleNode(const SimpleNode<kT, vT, Augment> &other):
         key(other.key),
         value(other.value),
         parent(nullptr),
         left(nullptr),
-        right(nullptr)
+        right(nullptr),
+        height(other.height),
+        augment(other.augment)
     {}
 
     SimpleNode() = delete;
-    SimpleNode(SimpleNode<kT, vT> &&) = delete;
+    SimpleNode(SimpleNode<kT, vT, Augment> &&) = delete;
 
     void adjust_insert()
     {
@@ -40,38 +53,61 @@ struct SimpleNode
         return;
     }
 
+    void adjust_build(std::size_t, std::size_t)
+    {
+        // built tree is already balanced, nothing to do here
+        return;
+    }
+
+    void update()
+    {
+        std::uint32_t left_h = this->left == nullptr ? 0 : this->left->height;
+        std::uint32_t right_h = this->right == nullptr ? 0 : this->right->height;
+        this->height = 1 + (left_h > right_h ? left_h : right_h);
+        this->augment.update(*this);
+    }
+
     void adjust_delete()
     {
         // in simple tree, before deleting a node we search for the replacement
 
-        SimpleNode<kT, vT> *replacement;
-
-        if (this->left != nullptr)
+        if (this->left != nullptr && this->right != nullptr)
         {
-            // replacement is a rightmost element in the left subtree
+            // replacement is a rightmost element in the left subtree; it does
+            // not have the right child, so it is easy to take it out
+            SimpleNode<kT, vT, Augment> *replacement;
             for (
                 replacement = this->left;
                 replacement->right != nullptr;
                 replacement = replacement->right
             );
+            replacement->adjust_delete();
+
+            // set replacement's parent and children to those of this
+            replacement->parent = this->parent;
+            replacement->left = this->left;
+            replacement->right = this->right;
+            if (replacement->left != nullptr)
+            {
+                replacement->left->parent = replacement;
+            }
+            replacement->right->parent = replacement;
+            this->replace_with(replacement);
+            return;
         }
-        else if (this->right != nullptr)
-        {
-            // this does not have left subtree - same logic for the right one
-            for (
-                replacement = this->right;
-                replacement->left != nullptr;
-                replacement = replacement->left
-            );
-        }
-        else
+
+        // this has at most one child, which simply takes its place
+        SimpleNode<kT, vT, Augment> *child = this->left == nullptr ? this->right : this->left;
+        if (child != nullptr)
         {
-            // this is a leaf = replacement is not needed
-            replacement = nullptr;
+            child->parent = this->parent;
         }
+        this->replace_with(child);
+    }
 
-        // if this has a parent - set its child (which now is this)
-        // to be replacement
+    // make the parent of this point to replacement instead
+    void replace_with(SimpleNode<kT, vT, Augment> *replacement)
+    {
         if (this->parent != nullptr)
         {
             if (this->parent->left == this)
@@ -83,21 +119,22 @@ struct SimpleNode
                 this->parent->right = replacement;
             }
         }
-
-        if (replacement != nullptr)
-        {
-            replacement->adjust_delete();
-
-            // set replacement's parent children to those of this
-            replacement->parent = this->parent;
-            replacement->left = this->left;
-            replacement->right = this->right;
-        }
     }
 
 #if defined _TREE_DEBUG && _TREE_DEBUG > 0
 
-    bool is_valid() const { return true; }
+    bool is_valid() const
+    {
+        std::uint32_t left_h = this->left == nullptr ? 0 : this->left->height;
+        std::uint32_t right_h = this->right == nullptr ? 0 : this->right->height;
+        if (this->height != 1 + (left_h > right_h ? left_h : right_h))
+        {
+            LOGV("invalid tree: wrong cached height");
+            return false;
+        }
+        return (this->left == nullptr || this->left->is_valid()) &&
+            (this->right == nullptr || this->right->is_valid());
+    }
 
     #include <iostream>
 
@@ -109,5 +146,7 @@ struct SimpleNode
 #endif
 };
 
-template <typename kT, typename vT>
-using SimpleTree = BaseTree<kT, vT, SimpleNode<kT, vT>>;
+template <typename kT, typename vT, class Compare = default_compare, class Augment = no_augment>
+using SimpleTree = BaseTree<kT, vT, SimpleNode<kT, vT, Augment>, Compare>;
+
+static_assert(key_value_tree<SimpleTree<int, int>>);
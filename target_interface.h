@@ -1,8 +1,67 @@
 #pragma once
 
+#include <concepts>
 #include <cstddef>
+#include <utility>
+#include <vector>
 
-// An interface for key-value binary search tree.
+// Statistics of the shape of a tree (the depth of the root is 1).
+struct tree_shape
+{
+    std::size_t size;
+    std::size_t height;
+
+    // The sum of depths of all the nodes.
+    std::size_t total_path_length;
+
+    // histogram[i] is the number of nodes at depth i + 1.
+    std::vector<std::size_t> histogram;
+
+    double average_path_length() const
+    {
+        return this->size == 0 ? 0.0 : double(this->total_path_length) / this->size;
+    }
+};
+
+// Compile-time interface for read-only key-value trees (e.g. frozen
+// snapshots): the read side of the key_value_tree below.
+template <class T>
+concept key_value_reader = requires(
+    const T const_tree,
+    const typename T::key_type &key,
+    typename T::mapped_type &dst
+)
+{
+    { const_tree.find(key, dst) } -> std::same_as<bool>;
+    { const_tree.lookup(key) } -> std::same_as<const typename T::mapped_type*>;
+    { const_tree.contains(key) } -> std::same_as<bool>;
+    { const_tree.size() } -> std::same_as<std::size_t>;
+    { const_tree.depth() } -> std::same_as<std::size_t>;
+    { const_tree.shape() } -> std::same_as<tree_shape>;
+};
+
+// Compile-time interface for key-value trees: a tree type T with key_type
+// and mapped_type member types must provide the same operations as the
+// KeyValueTree below (see there for the description). Code that is generic
+// over such trees should take them as template parameters, so that the calls
+// are dispatched statically (and can be inlined).
+template <class T>
+concept key_value_tree = key_value_reader<T> && requires(
+    T tree,
+    const typename T::key_type &key,
+    const typename T::mapped_type &value
+)
+{
+    { tree[key] } -> std::same_as<typename T::mapped_type&>;
+    { tree.insert(key, value) } -> std::same_as<bool>;
+    { tree.lookup(key) } -> std::same_as<typename T::mapped_type*>;
+    { tree.erase(key) } -> std::same_as<bool>;
+    tree.clear();
+};
+
+// An interface for key-value binary search tree (with dynamic dispatch).
+// Trees do not implement it directly; use VirtualTree (see below) to access
+// a tree through this interface.
 template<typename kT, typename vT>
 class KeyValueTree
 {
@@ -20,6 +79,29 @@ public:
     // Returns true if the key exists in the tree.
     virtual bool find(const kT &key, vT &dst) const = 0;
 
+    // Lookup a specific key without copying the value.
+    // Returns a ptr to the value stored in the tree or nullptr if the key is
+    // not found. The ptr stays valid until the next modification of the
+    // tree (the Node-based BaseTree keeps it until the key is erased, but
+    // other engines move or copy their values on any write).
+    virtual const vT *lookup(const kT &key) const = 0;
+    virtual vT *lookup(const kT &key) = 0;
+
+    // Lookup a specific key and call fn with a const reference to the value
+    // if it is found.
+    // Returns true if the key exists in the tree.
+    template <typename F>
+    bool find_and(const kT &key, F &&fn) const
+    {
+        const vT *value = this->lookup(key);
+        if (value == nullptr)
+        {
+            return false;
+        }
+        fn(*value);
+        return true;
+    }
+
     // Lookup a specific key.
     // Returns true if the key exists in the tree.
     virtual bool contains(const kT &key) const = 0;
@@ -38,7 +120,58 @@ public:
     // For research purposes.
     virtual std::size_t depth() const = 0;
 
+    // Get the statistics of the shape of the tree.
+    // For research purposes.
+    virtual tree_shape shape() const = 0;
+
     // Virtual destructor is needed to be able to properly delete trees even
     // if we access them only through ptrs to this interface.
     virtual ~KeyValueTree() {};
-};
\ No newline at end of file
+};
+
+
+// Adapter that exposes a tree through the KeyValueTree interface, e.g. to
+// keep trees of different types in one container. Every call goes through
+// the vtable, so code that knows the type of the tree should use get().
+template <key_value_tree Tree>
+class VirtualTree final : public KeyValueTree<typename Tree::key_type, typename Tree::mapped_type>
+{
+private:
+
+    using kT = typename Tree::key_type;
+    using vT = typename Tree::mapped_type;
+
+    Tree tree;
+
+public:
+
+    // Arguments are forwarded to the constructor of the tree.
+    template <typename... Args>
+    explicit VirtualTree(Args&&... args):
+        tree(std::forward<Args>(args)...)
+    {}
+
+    Tree &get() { return this->tree; }
+    const Tree &get() const { return this->tree; }
+
+    vT& operator[](const kT &key) override { return this->tree[key]; }
+
+    bool insert(const kT &key, const vT &value) override { return this->tree.insert(key, value); }
+
+    bool find(const kT &key, vT &dst) const override { return this->tree.find(key, dst); }
+
+    const vT *lookup(const kT &key) const override { return this->tree.lookup(key); }
+    vT *lookup(const kT &key) override { return this->tree.lookup(key); }
+
+    bool contains(const kT &key) const override { return this->tree.contains(key); }
+
+    std::size_t size() const override { return this->tree.size(); }
+
+    bool erase(const kT &key) override { return this->tree.erase(key); }
+
+    void clear() override { this->tree.clear(); }
+
+    std::size_t depth() const override { return this->tree.depth(); }
+
+    tree_shape shape() const override { return this->tree.shape(); }
+};
@@ -1,6 +1,11 @@
-// A simple test of kVTree implementation (without benchmarking).
+// A simple test of kVTree implementation (without benchmarking), followed by
+// checks of the other operations against std::map, which print nothing
+// unless they fail. Build with -D_TREE_DEBUG=1 to also check that the trees
+// stay valid after every modification (the output is then much longer).
 
+#ifndef _TREE_DEBUG
 #define _TREE_DEBUG 0 // this macro controls output to the console (see "common.h")
+#endif
 
 // Edit these 2 lines to change the type of the tree being tested
 
@@ -8,8 +13,17 @@
 #define TreeT AVLTree    // <<<<<
 
 
+#include "interval_tree.h"
+#include "persistent_tree.h"
+#include "rb_tree.h"
+#include "simple_tree.h"
+
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <random>
 #include <string>
+#include <vector>
 
 const char * crepr(const int num)
 {
@@ -67,6 +81,567 @@ void print(TreeT<kT, vT> &tree)
 #endif
 }
 
+// Checks
+
+int failures = 0;
+
+void check(bool ok, const std::string &what)
+{
+    if (!ok)
+    {
+        std::cout << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+// Insert (and sometimes erase) n random keys in [0, range) in the tree and in
+// expected alike.
+template <class Tree>
+void fill_random(Tree &tree, std::map<int, int> &expected, std::mt19937 &rng, int n, int range)
+{
+    for (int i = 0; i < n; i++)
+    {
+        int key = int(rng() % range);
+        if (rng() % 4 == 0)
+        {
+            tree.erase(key);
+            expected.erase(key);
+        }
+        else
+        {
+            tree.insert(key, i);
+            expected[key] = i;
+        }
+    }
+}
+
+// Tell if the tree has exactly the items of expected.
+template <class Tree>
+bool same_items(const Tree &tree, const std::map<int, int> &expected)
+{
+    if (tree.size() != expected.size())
+    {
+        return false;
+    }
+    auto it = expected.begin();
+    for (auto [key, value] : tree)
+    {
+        if (key != it->first || value != it->second)
+        {
+            return false;
+        }
+        ++it;
+    }
+    return true;
+}
+
+template <class Tree>
+void check_sorted_batch(const std::string &name)
+{
+    std::mt19937 rng(1234);
+    Tree tree;
+    std::map<int, int> expected;
+
+    std::vector<int> keys;
+    std::vector<const int*> out;
+    check(tree.find_sorted_batch(keys, out) == 0, name + ": find_sorted_batch of no keys");
+    keys = {1, 2, 3};
+    out.resize(keys.size());
+    check(tree.find_sorted_batch(keys, out) == 0 && out[0] == nullptr,
+        name + ": find_sorted_batch in an empty tree");
+
+    fill_random(tree, expected, rng, 500, 1000);
+    keys.clear();
+    for (int key = -5; key < 1005; key += 1 + int(rng() % 3))
+    {
+        keys.push_back(key);
+    }
+    out.resize(keys.size());
+
+    // keys out of order are searched from the root
+    for (bool sorted : {true, false})
+    {
+        std::size_t found = tree.find_sorted_batch(keys, out);
+        std::size_t expected_found = 0;
+        bool ok = true;
+        for (std::size_t i = 0; i < keys.size(); i++)
+        {
+            auto it = expected.find(keys[i]);
+            ok = ok && (it == expected.end() ? out[i] == nullptr : out[i] != nullptr && *out[i] == it->second);
+            expected_found += it != expected.end();
+        }
+        check(ok && found == expected_found,
+            name + ": find_sorted_batch of " + (sorted ? "sorted" : "unsorted") + " keys");
+        std::shuffle(keys.begin(), keys.end(), rng);
+    }
+}
+
+// Inserts (mostly hinted) interleaved with erasing the nodes the tree starts
+// the searches from (the last inserted node and the node with the greatest
+// key).
+template <class Tree>
+void check_hinted_inserts(const std::string &name)
+{
+    std::mt19937 rng(1234);
+    Tree tree;
+    std::map<int, int> expected;
+    int last = 0;
+
+    auto insert = [&](Tree &tree, std::map<int, int> &expected, int step)
+    {
+        int key = expected.empty() || rng() % 3 == 0 ?
+            int(rng() % 600) : expected.rbegin()->first + 1 + int(rng() % 3);
+        bool ok = true;
+        switch (rng() % 6)
+        {
+            case 0:
+            {
+                auto it = tree.try_emplace(tree.end(), key, step);
+                ok = (*it).first == key && (*it).second == expected.try_emplace(key, step).first->second;
+                break;
+            }
+            case 1:
+            {
+                auto it = tree.try_emplace(tree.lower_bound(key), key, step);
+                ok = (*it).first == key && (*it).second == expected.try_emplace(key, step).first->second;
+                break;
+            }
+            case 2:
+            {
+                auto it = tree.insert_or_assign(tree.end(), key, step);
+                expected[key] = step;
+                ok = (*it).first == key && (*it).second == step;
+                break;
+            }
+            case 3:
+            {
+                auto it = tree.insert_or_assign(tree.find(int(rng() % 600)), key, step);
+                expected[key] = step;
+                ok = (*it).first == key && (*it).second == step;
+                break;
+            }
+            // without a hint, the search starts from the last inserted node
+            case 4:
+                tree.insert(key, step);
+                expected[key] = step;
+                break;
+            default:
+                tree[key] = step;
+                expected[key] = step;
+        }
+        check(ok, name + ": hinted insert of " + std::to_string(key));
+        last = key;
+    };
+
+    for (int step = 0; step < 1500; step++)
+    {
+        switch (rng() % 5)
+        {
+            case 0:
+                tree.erase(last);
+                expected.erase(last);
+                break;
+            case 1:
+                if (!expected.empty())
+                {
+                    int max = expected.rbegin()->first;
+                    tree.erase(max);
+                    expected.erase(max);
+                }
+                break;
+            default:
+                insert(tree, expected, step);
+        }
+
+        if (step % 500 == 499)
+        {
+            Tree copy;
+            copy = tree;
+            std::map<int, int> copy_expected = expected;
+            insert(copy, copy_expected, step);
+            check(same_items(copy, copy_expected), name + ": insert after copy assignment");
+
+            Tree moved(std::move(copy));
+            insert(moved, copy_expected, step);
+            check(same_items(moved, copy_expected), name + ": insert after move");
+            std::map<int, int> empty;
+            insert(copy, empty, step);
+            check(same_items(copy, empty), name + ": insert into a moved-from tree");
+
+            tree = std::move(moved);
+            expected = copy_expected;
+        }
+    }
+    check(same_items(tree, expected), name + ": hinted inserts and erases");
+}
+
+// Compare rank, select and count_range of the tree with expected.
+template <class Tree>
+void check_order_statistics(const Tree &tree, const std::map<int, int> &expected,
+    std::mt19937 &rng, const std::string &name)
+{
+    bool ok = true;
+    std::size_t position = 0;
+    for (auto [key, value] : expected)
+    {
+        auto it = tree.select(position);
+        ok = ok && it != tree.end() && (*it).first == key && tree.rank(key) == position;
+        // keys are integers, so the keys less than key + 1 go up to key
+        ok = ok && tree.rank(key + 1) == position + 1;
+        position++;
+    }
+    check(ok, name + ": rank and select of every key");
+    check(tree.select(tree.size()) == tree.end() && tree.select(tree.size() + 10) == tree.end(),
+        name + ": select past the end");
+    check(tree.rank(-1) == 0 && tree.rank(1 << 20) == tree.size(), name + ": rank of absent keys");
+
+    ok = true;
+    for (int i = 0; i < 200; i++)
+    {
+        int lo = int(rng() % 1100) - 50;
+        int hi = int(rng() % 1100) - 50;
+        std::size_t count = lo > hi ? 0 :
+            std::size_t(std::distance(expected.lower_bound(lo), expected.upper_bound(hi)));
+        ok = ok && tree.count_range(lo, hi) == count;
+    }
+    check(ok, name + ": count_range (also with lo > hi)");
+}
+
+template <class Tree>
+void check_order_statistics(const std::string &name)
+{
+    std::mt19937 rng(1234);
+    Tree tree;
+    std::map<int, int> expected;
+    check_order_statistics(tree, expected, rng, name + " (empty)");
+
+    fill_random(tree, expected, rng, 600, 1000);
+    check_order_statistics(tree, expected, rng, name);
+
+    Tree built(expected.begin(), expected.end());
+    check_order_statistics(built, expected, rng, name + " (built)");
+    fill_random(built, expected, rng, 300, 1000);
+    check_order_statistics(built, expected, rng, name + " (built, then modified)");
+}
+
+// Compare aggregate (sums of values) of the tree with expected.
+template <class Tree>
+void check_sums(const Tree &tree, const std::map<int, int> &expected, std::mt19937 &rng,
+    const std::string &name)
+{
+    bool ok = true;
+    for (int i = 0; i < 200; i++)
+    {
+        int lo = int(rng() % 1100) - 50;
+        int hi = int(rng() % 1100) - 50;
+        long long sum = 0;
+        for (auto it = expected.lower_bound(lo); lo <= hi && it != expected.upper_bound(hi); ++it)
+        {
+            sum += it->second;
+        }
+        ok = ok && tree.aggregate(lo, hi) == sum;
+    }
+    check(ok, name + ": aggregate (also with lo > hi)");
+}
+
+template <class Tree>
+void check_aggregates(const std::string &name)
+{
+    std::mt19937 rng(1234);
+    Tree tree;
+    std::map<int, int> expected;
+    check_sums(tree, expected, rng, name + " (empty)");
+
+    fill_random(tree, expected, rng, 600, 1000);
+    check_sums(tree, expected, rng, name);
+
+    // values changed through references and assigned in place
+    for (int i = 0; i < 300; i++)
+    {
+        int key = int(rng() % 1000);
+        int value = int(rng() % 100);
+        switch (i % 4)
+        {
+            case 0:
+                tree[key] = value;
+                expected[key] = value;
+                break;
+            case 1:
+                tree[key] += value;
+                expected[key] += value;
+                break;
+            case 2:
+                if (int *found = tree.lookup(key))
+                {
+                    *found = value;
+                    expected[key] = value;
+                }
+                break;
+            default:
+                tree.insert_or_assign(tree.lower_bound(key), key, value);
+                expected[key] = value;
+        }
+        if (i % 50 == 49)
+        {
+            check_sums(tree, expected, rng, name + " (values changed)");
+        }
+    }
+    fill_random(tree, expected, rng, 100, 1000);
+    check_sums(tree, expected, rng, name + " (values changed, then erased)");
+
+    Tree built(expected.begin(), expected.end());
+    check_sums(built, expected, rng, name + " (built)");
+    fill_random(built, expected, rng, 300, 1000);
+    check_sums(built, expected, rng, name + " (built, then modified)");
+}
+
+// Compare for_each_overlapping with a scan of all the intervals of expected.
+void check_overlapping(const IntervalTree<int, int> &tree,
+    const std::map<interval<int>, int> &expected, std::mt19937 &rng, const std::string &name)
+{
+    bool ok = true;
+    for (int i = 0; i < 200 && ok; i++)
+    {
+        int lo = int(rng() % 1100) - 50;
+        int hi = i % 4 == 0 ? lo : lo + int(rng() % 100);
+        std::vector<std::pair<interval<int>, int>> found, scanned;
+        tree.for_each_overlapping(lo, hi,
+            [&](const interval<int> &key, const int &value) { found.emplace_back(key, value); });
+        for (const auto &[key, value] : expected)
+        {
+            if (key.lo <= hi && lo <= key.hi)
+            {
+                scanned.emplace_back(key, value);
+            }
+        }
+        ok = found == scanned;
+    }
+    check(ok, name + ": for_each_overlapping (also of points)");
+}
+
+void check_interval_tree()
+{
+    std::mt19937 rng(1234);
+    IntervalTree<int, int> tree;
+    std::map<interval<int>, int> expected;
+    check_overlapping(tree, expected, rng, "interval (empty)");
+
+    // mostly short intervals with a few long ones over them
+    for (int i = 0; i < 2000; i++)
+    {
+        int lo = int(rng() % 1000);
+        interval<int> key{lo, lo + int(rng() % (i % 16 == 0 ? 300 : 10))};
+        if (i % 4 == 3)
+        {
+            key = expected.empty() ? key : std::next(expected.begin(), rng() % expected.size())->first;
+            tree.erase(key);
+            expected.erase(key);
+        }
+        else
+        {
+            tree.insert(key, i);
+            expected[key] = i;
+        }
+        if (i % 500 == 499)
+        {
+            check_overlapping(tree, expected, rng, "interval");
+        }
+    }
+}
+
+// Split a tree with the items of expected at the key, modify both parts
+// and join them back.
+template <class Tree>
+void check_split_at(Tree &tree, std::map<int, int> &expected, int key, std::mt19937 &rng,
+    const std::string &name)
+{
+    Tree greater = tree.split(key);
+    std::map<int, int> expected_greater(expected.lower_bound(key), expected.end());
+    expected.erase(expected.lower_bound(key), expected.end());
+    check(same_items(tree, expected) && same_items(greater, expected_greater), name + ": split");
+
+    // both parts stay usable, also for keys on the other side of the split
+    for (int i = 0; i < 200; i++)
+    {
+        int new_key = int(rng() % 1200) - 100;
+        bool erase = rng() % 4 == 0;
+        Tree &part = i % 2 == 0 ? tree : greater;
+        std::map<int, int> &expected_part = i % 2 == 0 ? expected : expected_greater;
+        if (erase)
+        {
+            part.erase(new_key);
+            expected_part.erase(new_key);
+        }
+        else
+        {
+            part.insert(new_key, i);
+            expected_part[new_key] = i;
+        }
+    }
+    check(same_items(tree, expected) && same_items(greater, expected_greater),
+        name + ": inserts and erases after split");
+
+    while (!expected.empty() && expected.rbegin()->first >= key)
+    {
+        tree.erase(expected.rbegin()->first);
+        expected.erase(expected.rbegin()->first);
+    }
+    while (!expected_greater.empty() && expected_greater.begin()->first < key)
+    {
+        greater.erase(expected_greater.begin()->first);
+        expected_greater.erase(expected_greater.begin());
+    }
+    tree.join(std::move(greater));
+    expected.merge(expected_greater);
+    check(same_items(tree, expected) && greater.size() == 0, name + ": join");
+}
+
+// Compare the set operations on copies of a and b with the same on std::maps.
+template <class Tree>
+void check_set_operations(const Tree &a, const std::map<int, int> &expected_a, const Tree &b,
+    const std::map<int, int> &expected_b, std::mt19937 &rng, const std::string &name)
+{
+    // values of a are kept for keys in both
+    std::map<int, int> united = expected_a;
+    united.insert(expected_b.begin(), expected_b.end());
+    std::map<int, int> common, only_a;
+    for (const auto &[key, value] : expected_a)
+    {
+        (expected_b.contains(key) ? common : only_a).emplace(key, value);
+    }
+
+    Tree tree = a, other = b;
+    tree.set_union(std::move(other));
+    check(same_items(tree, united) && other.size() == 0, name + ": set_union");
+    fill_random(tree, united, rng, 200, 1000);
+    check(same_items(tree, united), name + ": inserts and erases after set_union");
+
+    tree = a;
+    other = b;
+    tree.set_intersection(std::move(other));
+    check(same_items(tree, common) && other.size() == 0, name + ": set_intersection");
+
+    tree = a;
+    other = b;
+    tree.set_difference(std::move(other));
+    check(same_items(tree, only_a) && other.size() == 0, name + ": set_difference");
+}
+
+template <class Tree>
+void check_joins(const std::string &name)
+{
+    std::mt19937 rng(1234);
+    Tree tree;
+    std::map<int, int> expected;
+    check_split_at(tree, expected, 0, rng, name + " (empty)");
+    tree.clear();
+    expected.clear();
+
+    fill_random(tree, expected, rng, 600, 1000);
+    check_split_at(tree, expected, std::next(expected.begin(), 100)->first, rng,
+        name + " (key present)");
+    int absent = 0;
+    while (expected.contains(absent))
+    {
+        absent++;
+    }
+    check_split_at(tree, expected, absent, rng, name + " (key absent)");
+    check_split_at(tree, expected, expected.begin()->first, rng, name + " (everything moves)");
+    check_split_at(tree, expected, expected.rbegin()->first + 1, rng, name + " (nothing moves)");
+
+    Tree empty;
+    Tree other;
+    std::map<int, int> expected_other;
+    fill_random(other, expected_other, rng, 600, 1000);
+    check_set_operations(empty, {}, empty, {}, rng, name + " (empty)");
+    check_set_operations(tree, expected, empty, {}, rng, name + " (with empty)");
+    check_set_operations(empty, {}, tree, expected, rng, name + " (empty with)");
+    check_set_operations(tree, expected, other, expected_other, rng, name);
+    check_set_operations(other, expected_other, tree, expected, rng, name + " (swapped)");
+
+    // disjoint trees, side by side and interleaved
+    std::map<int, int> low, high, even, odd;
+    for (int i = 0; i < 1000; i++)
+    {
+        (i < 500 ? low : high).emplace(i, i);
+        (i % 2 == 0 ? even : odd).emplace(i, -i);
+    }
+    check_set_operations(Tree(low.begin(), low.end()), low, Tree(high.begin(), high.end()), high,
+        rng, name + " (disjoint)");
+    check_set_operations(Tree(high.begin(), high.end()), high, Tree(low.begin(), low.end()), low,
+        rng, name + " (disjoint, swapped)");
+    check_set_operations(Tree(even.begin(), even.end()), even, Tree(odd.begin(), odd.end()), odd,
+        rng, name + " (interleaved)");
+
+    // trees big enough to be processed in parallel
+    std::map<int, int> big, big_other;
+    for (int i = 0; i < 1 << 15; i++)
+    {
+        big.emplace(int(rng() % (1 << 16)), i);
+        big_other.emplace(int(rng() % (1 << 16)), -i);
+    }
+    check_set_operations(Tree(big.begin(), big.end()), big, Tree(big_other.begin(), big_other.end()),
+        big_other, rng, name + " (big)");
+}
+
+// Tell if the snapshot has exactly the items of expected.
+template <class Snapshot>
+bool same_snapshot(const Snapshot &snapshot, const std::map<int, int> &expected)
+{
+    std::vector<std::pair<const int, int>> items;
+    snapshot.for_each([&](const int &key, const int &value) { items.emplace_back(key, value); });
+    bool ok = snapshot.size() == expected.size() &&
+        std::equal(items.begin(), items.end(), expected.begin(), expected.end());
+    for (int key = -1; key <= 1000 && ok; key++)
+    {
+        const int *value = snapshot.lookup(key);
+        ok = value == nullptr ? !expected.contains(key) : expected.contains(key) && *value == expected.at(key);
+    }
+    return ok;
+}
+
+void check_snapshots()
+{
+    using Tree = PersistentRBTree<int, int>;
+
+    std::mt19937 rng(1234);
+    Tree tree;
+    std::map<int, int> expected;
+    std::vector<std::pair<Tree::Snapshot, std::map<int, int>>> snapshots;
+    snapshots.emplace_back(tree.snapshot(), expected);
+
+    // every snapshot keeps its version while the tree changes (values are
+    // replaced too, so the copied paths have to differ)
+    for (int i = 0; i < 10; i++)
+    {
+        fill_random(tree, expected, rng, 200, 1000);
+        snapshots.emplace_back(tree.snapshot(), expected);
+    }
+    const int *kept = snapshots[5].first.lookup(snapshots[5].second.begin()->first);
+    int kept_value = snapshots[5].second.begin()->second;
+    tree.clear();
+    expected.clear();
+    snapshots.emplace_back(tree.snapshot(), expected);
+    fill_random(tree, expected, rng, 200, 1000);
+
+    bool ok = same_snapshot(tree.snapshot(), expected);
+    for (const auto &[snapshot, items] : snapshots)
+    {
+        ok = ok && same_snapshot(snapshot, items);
+    }
+    check(ok && *kept == kept_value, "persistent: snapshots after later inserts, erases and clear");
+
+    // a tree built from a range and its copied snapshots
+    Tree built(expected.begin(), expected.end());
+    Tree::Snapshot before = built.snapshot();
+    Tree::Snapshot copy = before;
+    std::map<int, int> expected_before = expected;
+    fill_random(built, expected, rng, 300, 1000);
+    before = Tree::Snapshot();
+    check(same_snapshot(copy, expected_before) && same_snapshot(built.snapshot(), expected) &&
+        same_snapshot(before, {}), "persistent: snapshots of a built tree");
+}
+
 int main()
 {
     TreeT<int, std::string> tree;
@@ -128,9 +703,33 @@ int main()
         "other: " << other.size() << std::endl <<
         "another: " << another.size() << std::endl;
 
+    check_sorted_batch<RBTree<int, int>>("red-black");
+    check_sorted_batch<AVLTree<int, int>>("avl");
+    check_sorted_batch<SimpleTree<int, int>>("simple");
+
+    check_hinted_inserts<RBTree<int, int>>("red-black");
+    check_hinted_inserts<AVLTree<int, int>>("avl");
+    check_hinted_inserts<SimpleTree<int, int>>("simple");
+
+    check_order_statistics<RBTree<int, int, default_compare, subtree_size>>("red-black");
+    check_order_statistics<AVLTree<int, int, default_compare, subtree_size>>("avl");
+    check_order_statistics<SimpleTree<int, int, default_compare, subtree_size>>("simple");
+
+    check_aggregates<RBTree<int, int, default_compare, aggregate<value_sum<long long>>>>("red-black");
+    check_aggregates<AVLTree<int, int, default_compare, aggregate<value_sum<long long>>>>("avl");
+    check_aggregates<SimpleTree<int, int, default_compare, aggregate<value_sum<long long>>>>("simple");
+
+    check_interval_tree();
+
+    check_joins<RBTree<int, int>>("red-black");
+    check_joins<RBTree<int, int, default_compare, subtree_size>>("red-black (sized)");
+
+    check_snapshots();
+
+    return failures == 0 ? 0 : 1;
 }
 
-// Expected output (with _TREE_DEBUG == 0):
+// Expected output (with _TREE_DEBUG == 0 and all the checks passing):
 
 /*
 5 : five